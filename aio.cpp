@@ -0,0 +1,389 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "aio.h"
+
+AsyncDisk::AsyncDisk(Disk& disk, unsigned queue_depth, bool use_uring)
+    : disk(disk), fd(-1), queue_depth(queue_depth), uring(false), in_flight(0),
+      ring_fd(-1), sq_ring(nullptr), cq_ring(nullptr), sqes(nullptr), stopping(false), failures(0)
+{
+    if (this->queue_depth == 0)
+        this->queue_depth = 1;
+    slots.resize(this->queue_depth);
+    for (unsigned i = this->queue_depth; i > 0; i--)
+        free_slots.push_back(i - 1);
+
+    // requests go to the disk file through a descriptor of their own
+    fd = open(DISKNAME, O_RDWR);
+    if (fd == -1)
+    {
+        std::cerr << "AsyncDisk - ERROR: Can't open diskfile: " << DISKNAME << std::endl;
+        return;
+    }
+    if (use_uring && setup_uring())
+    {
+        uring = true;
+        return;
+    }
+    // no io_uring, emulate it with a pool of threads
+    unsigned nthreads = std::min(this->queue_depth, (unsigned)AIO_MAX_THREADS);
+    for (unsigned i = 0; i < nthreads; i++)
+        workers.push_back(std::thread(&AsyncDisk::worker, this));
+}
+
+AsyncDisk::~AsyncDisk()
+{
+    wait();
+    if (uring)
+        teardown_uring();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto& t : workers)
+        t.join();
+    if (fd != -1)
+        close(fd);
+}
+
+// sets up an io_uring with one submission entry per slot
+bool AsyncDisk::setup_uring()
+{
+    struct io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, queue_depth, &p);
+    if (ring_fd < 0)
+        return false;
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+        sq_ring = nullptr;
+        teardown_uring();
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else
+    {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+        {
+            cq_ring = nullptr;
+            teardown_uring();
+            return false;
+        }
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (s == MAP_FAILED)
+    {
+        teardown_uring();
+        return false;
+    }
+    sqes = (struct io_uring_sqe*)s;
+
+    uint8_t* sq = (uint8_t*)sq_ring;
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    uint8_t* cq = (uint8_t*)cq_ring;
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return true;
+}
+
+void AsyncDisk::teardown_uring()
+{
+    if (sqes != nullptr)
+        munmap(sqes, sqes_size);
+    if (cq_ring != nullptr && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring != nullptr)
+        munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+    sqes = nullptr;
+    sq_ring = cq_ring = nullptr;
+    ring_fd = -1;
+}
+
+// a worker of the thread pool fallback, runs requests with pread/pwrite
+void AsyncDisk::worker()
+{
+    while (true)
+    {
+        unsigned slot;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            work_ready.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty())
+                return;
+            slot = pending.front();
+            pending.pop_front();
+        }
+        request& r = slots[slot];
+        size_t len = r.iov.iov_len, done = 0;
+        off_t offset = (off_t)r.block_no * disk.get_block_size();
+        while (done < len)
+        {
+            ssize_t n = r.write ? pwrite(fd, r.buf + done, len - done, offset + done)
+                                : pread(fd, r.buf + done, len - done, offset + done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        r.result = done == len ? 0 : -1;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            completed.push_back(slot);
+        }
+        work_done.notify_one();
+    }
+}
+
+int AsyncDisk::enqueue(bool write, unsigned block_no, unsigned count, uint8_t* buf, aio_callback done)
+{
+    if (fd == -1)
+        return -1;
+    if (count == 0 || block_no + count > disk.get_no_blocks())
+    {
+        std::cout << "AsyncDisk - ERROR: Invalid block range (" << block_no << ", " << count << ")\n";
+        return -1;
+    }
+    // every slot is taken, make room by waiting for a completion
+    while (free_slots.empty())
+    {
+        submit();
+        if (reap(1))
+            return -1;
+    }
+    unsigned slot = free_slots.back();
+    free_slots.pop_back();
+    request& r = slots[slot];
+    r.write = write;
+    r.block_no = block_no;
+    r.count = count;
+    r.buf = buf;
+    r.done = done;
+    r.iov.iov_base = buf;
+    r.iov.iov_len = (size_t)count * disk.get_block_size();
+    r.result = -1;
+    queued.push_back(slot);
+    return 0;
+}
+
+// queues a read of count blocks starting at block_no into buf
+int AsyncDisk::read(unsigned block_no, unsigned count, uint8_t* buf, aio_callback done)
+{
+    return enqueue(false, block_no, count, buf, done);
+}
+
+// queues a write of count blocks from buf starting at block_no
+int AsyncDisk::write(unsigned block_no, unsigned count, const uint8_t* buf, aio_callback done)
+{
+    return enqueue(true, block_no, count, (uint8_t*)buf, done);
+}
+
+// hands all queued requests to the kernel or the worker threads at once
+int AsyncDisk::submit()
+{
+    if (queued.empty())
+        return 0;
+    if (!uring)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.insert(pending.end(), queued.begin(), queued.end());
+        }
+        in_flight += queued.size();
+        queued.clear();
+        work_ready.notify_all();
+        return 0;
+    }
+
+    unsigned tail = *sq_tail;
+    for (auto slot : queued)
+    {
+        request& r = slots[slot];
+        unsigned index = tail & *sq_mask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = r.write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)&r.iov;
+        sqe->len = 1;
+        sqe->off = (uint64_t)r.block_no * disk.get_block_size();
+        sqe->user_data = slot;
+        sq_array[index] = index;
+        tail++;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    // one system call submits the whole batch
+    unsigned to_submit = queued.size();
+    while (to_submit > 0)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            std::cerr << "AsyncDisk - ERROR: io_uring_enter failed: " << strerror(errno) << std::endl;
+            return -1;
+        }
+        to_submit -= ret;
+    }
+    in_flight += queued.size();
+    queued.clear();
+    return 0;
+}
+
+// reaps completed requests and runs their callbacks, blocking until at
+// least min_complete have completed
+int AsyncDisk::reap(unsigned min_complete)
+{
+    min_complete = std::min(min_complete, in_flight);
+    std::vector<unsigned> finished;
+    if (uring)
+    {
+        while (true)
+        {
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++)
+            {
+                struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+                request& r = slots[cqe->user_data];
+                r.result = cqe->res == (int)r.iov.iov_len ? 0 : -1;
+                finished.push_back(cqe->user_data);
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if (finished.size() >= min_complete)
+                break;
+            int ret = syscall(__NR_io_uring_enter, ring_fd, 0, min_complete - finished.size(), IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0 && errno != EINTR)
+            {
+                std::cerr << "AsyncDisk - ERROR: io_uring_enter failed: " << strerror(errno) << std::endl;
+                return -1;
+            }
+        }
+    }
+    else
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        work_done.wait(guard, [this, min_complete] { return completed.size() >= min_complete; });
+        finished.assign(completed.begin(), completed.end());
+        completed.clear();
+    }
+
+    // free the slots before running callbacks, which may queue new requests
+    std::vector<std::pair<aio_callback, int>> callbacks;
+    for (auto slot : finished)
+    {
+        request& r = slots[slot];
+        if (r.result)
+            failures++;
+        callbacks.push_back(std::make_pair(r.done, r.result));
+        r.done = nullptr;
+        free_slots.push_back(slot);
+        in_flight--;
+    }
+    for (auto& cb : callbacks)
+        if (cb.first)
+            cb.first(cb.second);
+    return 0;
+}
+
+// runs the callbacks of requests that have already completed
+int AsyncDisk::poll()
+{
+    return reap(0);
+}
+
+// submits everything queued and waits until no request is in flight
+int AsyncDisk::wait()
+{
+    // callbacks may queue more requests, so loop until everything is done
+    while (!queued.empty() || in_flight > 0)
+    {
+        if (submit())
+            return -1;
+        if (in_flight > 0 && reap(1))
+            return -1;
+    }
+    int ret = failures > 0 ? -1 : 0;
+    failures = 0;
+    return ret;
+}
+
+// reads every block of the disk in random order at queue depths 1, 8,
+// 32 and 128 and prints the throughput of each
+int AsyncDisk::benchmark(Disk& disk)
+{
+    const unsigned depths[] = { 1, 8, 32, 128 };
+    unsigned nblocks = disk.get_no_blocks();
+    std::vector<unsigned> order(nblocks);
+    for (unsigned i = 0; i < nblocks; i++)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+    for (int engine = 0; engine < 2; engine++)
+    {
+        for (auto depth : depths)
+        {
+            AsyncDisk aio(disk, depth, engine == 0);
+            if (engine == 0 && !aio.using_uring())
+            {
+                std::cout << "io_uring is not available, skipping it\n";
+                break;
+            }
+            // one buffer per request in flight, returned by the callbacks
+            std::vector<uint8_t> buffers((size_t)depth * disk.get_block_size());
+            std::vector<uint8_t*> free_buffers;
+            for (unsigned i = 0; i < depth; i++)
+                free_buffers.push_back(buffers.data() + (size_t)i * disk.get_block_size());
+
+            auto start = std::chrono::steady_clock::now();
+            for (auto block_no : order)
+            {
+                while (free_buffers.empty())
+                {
+                    aio.submit();
+                    aio.reap(1);
+                }
+                uint8_t* buf = free_buffers.back();
+                free_buffers.pop_back();
+                aio.read(block_no, 1, buf, [&free_buffers, buf](int) { free_buffers.push_back(buf); });
+                // submit in batches of the queue depth
+                if (aio.queued.size() >= depth)
+                    aio.submit();
+            }
+            int ret = aio.wait();
+            std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+            double mb = (double)disk.get_disk_size() / (1024 * 1024);
+            std::cout << (aio.using_uring() ? "io_uring" : "threads ") << "  qd " << depth
+                      << "\t" << mb / secs.count() << " MB/s\t" << nblocks / secs.count() << " IOPS"
+                      << (ret ? "\t(errors)" : "") << std::endl;
+        }
+    }
+    return 0;
+}
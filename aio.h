@@ -0,0 +1,111 @@
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/uio.h>
+#include "disk.h"
+
+#ifndef __AIO_H__
+#define __AIO_H__
+
+#define AIO_QUEUE_DEPTH 32
+// the thread pool fallback never starts more workers than this
+#define AIO_MAX_THREADS 16
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// called when an asynchronous request completes, with 0 on success or -1
+typedef std::function<void(int)> aio_callback;
+
+// Asynchronous block I/O on the disk file. Requests are queued by read()
+// and write() and handed to the kernel in one batch by submit(), with at
+// most queue_depth requests in flight. io_uring is used when the kernel
+// supports it, otherwise a pool of threads emulates it with pread/pwrite.
+// Completion callbacks always run on the calling thread, inside poll()
+// and wait().
+class AsyncDisk
+{
+private:
+    struct request
+    {
+        bool write;
+        unsigned block_no;
+        unsigned count;
+        uint8_t* buf;
+        aio_callback done;
+        struct iovec iov;
+        int result;
+    };
+    Disk& disk;
+    int fd;
+    unsigned queue_depth;
+    bool uring;
+    // requests by slot, the slot index is the io_uring user_data
+    std::vector<request> slots;
+    std::vector<unsigned> free_slots;
+    // slots queued by read()/write() but not yet submitted
+    std::vector<unsigned> queued;
+    unsigned in_flight;
+
+    // io_uring rings, mapped from the kernel
+    int ring_fd;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // thread pool fallback
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    std::deque<unsigned> pending;
+    std::deque<unsigned> completed;
+    bool stopping;
+    // requests that failed since the last wait()
+    unsigned failures;
+
+    bool setup_uring();
+    void teardown_uring();
+    void worker();
+    int enqueue(bool write, unsigned block_no, unsigned count, uint8_t* buf, aio_callback done);
+    // reaps completed requests and runs their callbacks, blocking until at
+    // least min_complete have completed
+    int reap(unsigned min_complete);
+public:
+    AsyncDisk(Disk& disk, unsigned queue_depth = AIO_QUEUE_DEPTH, bool use_uring = true);
+    ~AsyncDisk();
+    bool using_uring() { return uring; }
+    unsigned get_queue_depth() { return queue_depth; }
+    // queues a read of count blocks starting at block_no into buf
+    int read(unsigned block_no, unsigned count, uint8_t* buf, aio_callback done);
+    // queues a write of count blocks from buf starting at block_no
+    int write(unsigned block_no, unsigned count, const uint8_t* buf, aio_callback done);
+    // hands all queued requests to the kernel or the worker threads at once
+    int submit();
+    // runs the callbacks of requests that have already completed
+    int poll();
+    // submits everything queued and waits until no request is in flight
+    int wait();
+
+    // reads every block of the disk in random order at queue depths 1, 8,
+    // 32 and 128 and prints the throughput of each
+    static int benchmark(Disk& disk);
+};
+
+#endif // __AIO_H__
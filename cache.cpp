@@ -0,0 +1,250 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include "cache.h"
+
+BlockCache::BlockCache(Disk& disk, unsigned capacity)
+    : disk(disk), capacity(capacity), hits(0), misses(0), evictions(0), writebacks(0)
+{
+    if (this->capacity == 0)
+        this->capacity = 1;
+}
+
+BlockCache::~BlockCache()
+{
+    sync();
+}
+
+// returns the frame holding block_no, loading it from the disk if
+// load is set, or nullptr on error
+BlockCache::frame* BlockCache::lookup(unsigned block_no, bool load)
+{
+    auto it = index.find(block_no);
+    if (it != index.end())
+    {
+        hits++;
+        // move the frame to the front of the LRU list
+        lru.splice(lru.begin(), lru, it->second);
+        return &*it->second;
+    }
+
+    misses++;
+    if (lru.size() >= capacity && evict())
+        return nullptr;
+
+    lru.push_front(frame());
+    frame& f = lru.front();
+    f.block_no = block_no;
+    f.dirty = false;
+    f.pins = 0;
+    f.data.resize(disk.get_block_size());
+    if (load && disk.read(block_no, f.data.data()))
+    {
+        lru.pop_front();
+        return nullptr;
+    }
+    index[block_no] = lru.begin();
+    return &f;
+}
+
+// evicts the least recently used frame that is not pinned
+int BlockCache::evict()
+{
+    auto it = lru.end();
+    do
+    {
+        // if every frame is pinned the cache grows past its capacity
+        if (it == lru.begin())
+            return 0;
+        --it;
+    } while (it->pins > 0);
+
+    if (it->dirty)
+    {
+        if (disk.write(it->block_no, it->data.data()))
+            return -1;
+        writebacks++;
+    }
+    index.erase(it->block_no);
+    lru.erase(it);
+    evictions++;
+    return 0;
+}
+
+// reads one block, from the cache if it is present
+int BlockCache::read(unsigned block_no, uint8_t* blk)
+{
+    frame* f = lookup(block_no, true);
+    if (f == nullptr)
+        return -1;
+    std::memcpy(blk, f->data.data(), disk.get_block_size());
+    return 0;
+}
+
+// writes one block to the cache, it reaches the disk on eviction or sync
+int BlockCache::write(unsigned block_no, const uint8_t* blk)
+{
+    if (block_no >= disk.get_no_blocks())
+    {
+        std::cout << "BlockCache::write - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    // the whole block is overwritten, so there is no need to read it first
+    frame* f = lookup(block_no, false);
+    if (f == nullptr)
+        return -1;
+    std::memcpy(f->data.data(), blk, disk.get_block_size());
+    f->dirty = true;
+    return 0;
+}
+
+// reads many blocks, cached blocks are copied from the cache and the
+// rest are read with vectored I/O without being added to the cache
+int BlockCache::read_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks)
+{
+    std::vector<unsigned> uncached_nos;
+    std::vector<uint8_t*> uncached_blks;
+    for (size_t i = 0; i < block_nos.size(); i++)
+    {
+        auto it = index.find(block_nos[i]);
+        if (it != index.end())
+        {
+            hits++;
+            std::memcpy(blks[i], it->second->data.data(), disk.get_block_size());
+        }
+        else
+        {
+            misses++;
+            uncached_nos.push_back(block_nos[i]);
+            uncached_blks.push_back(blks[i]);
+        }
+    }
+    if (uncached_nos.empty())
+        return 0;
+    return disk.read_blocks(uncached_nos, uncached_blks);
+}
+
+// writes many blocks straight through to the disk with vectored I/O,
+// cached copies of the blocks are updated
+int BlockCache::write_blocks(const std::vector<unsigned>& block_nos, const std::vector<const uint8_t*>& blks)
+{
+    if (disk.write_blocks(block_nos, blks))
+        return -1;
+    for (size_t i = 0; i < block_nos.size(); i++)
+    {
+        auto it = index.find(block_nos[i]);
+        if (it != index.end())
+        {
+            // the disk now holds the newest data for this block
+            std::memcpy(it->second->data.data(), blks[i], disk.get_block_size());
+            it->second->dirty = false;
+        }
+    }
+    return 0;
+}
+
+// writes the given blocks back to the disk if they are dirty, so the
+// disk can be read around the cache
+int BlockCache::writeback(const std::vector<unsigned>& block_nos)
+{
+    for (auto block_no : block_nos)
+    {
+        auto it = index.find(block_no);
+        if (it == index.end() || !it->second->dirty)
+            continue;
+        if (disk.write(block_no, it->second->data.data()))
+            return -1;
+        it->second->dirty = false;
+        writebacks++;
+    }
+    return 0;
+}
+
+// drops the given blocks without writing them back, after the disk was
+// written around the cache
+void BlockCache::discard(const std::vector<unsigned>& block_nos)
+{
+    for (auto block_no : block_nos)
+    {
+        auto it = index.find(block_no);
+        if (it == index.end() || it->second->pins > 0)
+            continue;
+        lru.erase(it->second);
+        index.erase(it);
+    }
+}
+
+// borrows one block without copying it, the pointer stays valid until
+// unpin(block_no); it points into the disk mapping when the block is
+// not cached and the disk can be viewed directly
+const uint8_t* BlockCache::pin(unsigned block_no)
+{
+    auto it = index.find(block_no);
+    if (it == index.end())
+    {
+        const uint8_t* blk = disk.view(block_no);
+        if (blk != nullptr)
+        {
+            // served by the mapping, there is no frame to pin
+            misses++;
+            mapped_pins[block_no]++;
+            return blk;
+        }
+    }
+    frame* f = lookup(block_no, true);
+    if (f == nullptr)
+        return nullptr;
+    f->pins++;
+    return f->data.data();
+}
+
+// releases a block borrowed with pin()
+void BlockCache::unpin(unsigned block_no)
+{
+    auto mit = mapped_pins.find(block_no);
+    if (mit != mapped_pins.end())
+    {
+        if (--mit->second == 0)
+            mapped_pins.erase(mit);
+        return;
+    }
+    auto it = index.find(block_no);
+    if (it != index.end() && it->second->pins > 0)
+        it->second->pins--;
+}
+
+// writes all dirty blocks back to the disk and syncs it, pinned blocks
+// stay dirty in the cache if skip_pinned is set
+int BlockCache::sync(bool skip_pinned)
+{
+    // write back in block order so the disk file is written sequentially
+    std::vector<frame*> dirty;
+    for (auto& f : lru)
+        if (f.dirty && !(skip_pinned && f.pins > 0))
+            dirty.push_back(&f);
+    std::sort(dirty.begin(), dirty.end(), [](const frame* a, const frame* b) { return a->block_no < b->block_no; });
+
+    // contiguous runs of dirty blocks are written with one vectored call
+    std::vector<unsigned> block_nos;
+    std::vector<const uint8_t*> blks;
+    for (auto f : dirty)
+    {
+        block_nos.push_back(f->block_no);
+        blks.push_back(f->data.data());
+    }
+    if (disk.write_blocks(block_nos, blks))
+        return -1;
+    for (auto f : dirty)
+        f->dirty = false;
+    writebacks += dirty.size();
+
+    // make the written blocks durable
+    return disk.sync();
+}
+
+// drops all cached blocks without writing them back
+void BlockCache::invalidate()
+{
+    index.clear();
+    lru.clear();
+}
@@ -0,0 +1,84 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include "disk.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#define CACHE_BLOCKS 128
+
+// A bounded LRU cache of disk blocks with write-back of dirty blocks.
+// Blocks are written to the disk when they are evicted, on sync() and
+// when the cache is destroyed.
+class BlockCache
+{
+private:
+    struct frame
+    {
+        unsigned block_no;
+        bool dirty;
+        // pinned frames are never evicted
+        unsigned pins;
+        std::vector<uint8_t> data;
+    };
+    Disk& disk;
+    unsigned capacity;
+    // most recently used frame first
+    std::list<frame> lru;
+    std::unordered_map<unsigned, std::list<frame>::iterator> index;
+    // blocks pinned straight from the disk mapping, with their pin counts
+    std::unordered_map<unsigned, unsigned> mapped_pins;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+
+    // returns the frame holding block_no, loading it from the disk if
+    // load is set, or nullptr on error
+    frame* lookup(unsigned block_no, bool load);
+    // evicts the least recently used frame that is not pinned
+    int evict();
+public:
+    BlockCache(Disk& disk, unsigned capacity = CACHE_BLOCKS);
+    ~BlockCache();
+    // reads one block, from the cache if it is present
+    int read(unsigned block_no, uint8_t* blk);
+    // writes one block to the cache, it reaches the disk on eviction or sync
+    int write(unsigned block_no, const uint8_t* blk);
+    // reads many blocks, cached blocks are copied from the cache and the
+    // rest are read with vectored I/O without being added to the cache
+    int read_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks);
+    // writes many blocks straight through to the disk with vectored I/O,
+    // cached copies of the blocks are updated
+    int write_blocks(const std::vector<unsigned>& block_nos, const std::vector<const uint8_t*>& blks);
+    // writes the given blocks back to the disk if they are dirty, so the
+    // disk can be read around the cache
+    int writeback(const std::vector<unsigned>& block_nos);
+    // drops the given blocks without writing them back, after the disk was
+    // written around the cache
+    void discard(const std::vector<unsigned>& block_nos);
+    // borrows one block without copying it, the pointer stays valid until
+    // unpin(block_no); it points into the disk mapping when the block is
+    // not cached and the disk can be viewed directly
+    const uint8_t* pin(unsigned block_no);
+    // releases a block borrowed with pin()
+    void unpin(unsigned block_no);
+    // writes all dirty blocks back to the disk and syncs it, pinned blocks
+    // stay dirty in the cache if skip_pinned is set
+    int sync(bool skip_pinned = false);
+    // drops all cached blocks without writing them back
+    void invalidate();
+
+    unsigned get_capacity() { return capacity; }
+    unsigned get_size() { return lru.size(); }
+    uint64_t get_hits() { return hits; }
+    uint64_t get_misses() { return misses; }
+    uint64_t get_evictions() { return evictions; }
+    uint64_t get_writebacks() { return writebacks; }
+};
+
+#endif // __CACHE_H__
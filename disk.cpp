@@ -1,7 +1,15 @@
 #include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "disk.h"
 
-Disk::Disk()
+Disk::Disk(int backend) : backend(backend), fd(-1), map(nullptr)
 {
     // first check if the disk file exists, otherwise create it.
     if (!disk_file_exists(DISKNAME))
@@ -9,12 +17,21 @@ Disk::Disk()
         std::cout << "No disk file found...\n";
         std::cout << "Creating disk file: " << DISKNAME << std::endl;
         std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1 << 23) - 1);
+        f.seekp((uint64_t)DEFAULT_BLOCK_SIZE * DEFAULT_NO_BLOCKS - 1);
         f.write("", 1);
     }
-    // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open())
+    // until the file system tells otherwise, the disk file is divided in
+    // blocks of the default size
+    struct stat st;
+    if (stat(DISKNAME, &st) == -1)
+    {
+        std::cerr << "ERROR: Can't stat diskfile: " << DISKNAME << ", exiting..." << std::endl;
+        exit(-1);
+    }
+    block_size = DEFAULT_BLOCK_SIZE;
+    no_blocks = st.st_size / block_size;
+    disk_size = (uint64_t)block_size * no_blocks;
+    if (!open_disk_file())
     {
         std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..." << std::endl;
         exit(-1);
@@ -23,7 +40,7 @@ Disk::Disk()
 
 Disk::~Disk()
 {
-    diskfile.close();
+    close_disk_file();
 }
 
 bool Disk::disk_file_exists(const std::string& name)
@@ -32,8 +49,97 @@ bool Disk::disk_file_exists(const std::string& name)
     return f.good();
 }
 
+// opens the disk file for the backend, the mmap backend maps all of it
+bool Disk::open_disk_file()
+{
+    if (backend == DISK_FSTREAM)
+    {
+        // the disk is simulated as a binary file
+        diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
+        return diskfile.is_open();
+    }
+    // the disk is simulated as a binary file accessed with positional I/O,
+    // or as a shared mapping of it
+    fd = open(DISKNAME, O_RDWR);
+    if (fd == -1)
+        return false;
+    if (backend != DISK_MMAP || disk_size == 0)
+        return true;
+    void* p = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+    map = (uint8_t*)p;
+    return true;
+}
+
+void Disk::close_disk_file()
+{
+    if (map != nullptr)
+    {
+        msync(map, disk_size, MS_SYNC);
+        munmap(map, disk_size);
+        map = nullptr;
+    }
+    if (fd != -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+    if (diskfile.is_open())
+        diskfile.close();
+}
+
+// changes the block size and number of blocks, the disk file is resized
+// to fit them exactly
+int Disk::set_geometry(unsigned block_size, unsigned no_blocks)
+{
+    uint64_t size = (uint64_t)block_size * no_blocks;
+    close_disk_file();
+    if (size != disk_size && truncate(DISKNAME, size) == -1)
+    {
+        std::cerr << "Disk::set_geometry - ERROR: Can't resize diskfile to " << size << " bytes\n";
+        open_disk_file();
+        return -1;
+    }
+    this->block_size = block_size;
+    this->no_blocks = no_blocks;
+    disk_size = size;
+    if (!open_disk_file())
+    {
+        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..." << std::endl;
+        exit(-1);
+    }
+    return 0;
+}
+
+// zeroes the whole disk without writing it, the blocks are punched out
+// of the disk file, or it is truncated and grown again, so it is sparse
+int Disk::discard()
+{
+    close_disk_file();
+    int ret = 0;
+    int f = open(DISKNAME, O_RDWR);
+    if (f == -1)
+        ret = -1;
+    else
+    {
+        // file systems that cannot punch holes still free the blocks of a
+        // truncated file
+        if (fallocate(f, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, disk_size) == -1
+            && (ftruncate(f, 0) == -1 || ftruncate(f, disk_size) == -1))
+            ret = -1;
+        close(f);
+    }
+    if (!open_disk_file())
+    {
+        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..." << std::endl;
+        exit(-1);
+    }
+    return ret;
+}
+
 // writes one block to the disk
-int Disk::write(unsigned block_no, uint8_t* blk)
+int Disk::write(unsigned block_no, const uint8_t* blk)
 {
     if (DEBUG)
         std::cout << "Disk::write(" << block_no << ")\n";
@@ -43,9 +149,17 @@ int Disk::write(unsigned block_no, uint8_t* blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
+    uint64_t offset = (uint64_t)block_no * block_size;
+    if (backend == DISK_MMAP)
+    {
+        // durability is deferred to sync()
+        std::memcpy(map + offset, blk, block_size);
+        return 0;
+    }
+    if (backend == DISK_PREAD)
+        return pwrite(fd, blk, block_size, offset) == (ssize_t)block_size ? 0 : -1;
     diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
+    diskfile.write((char*)blk, block_size);
     diskfile.flush();
     return 0;
 }
@@ -57,11 +171,146 @@ int Disk::read(unsigned block_no, uint8_t* blk)
         std::cout << "Disk::read(" << block_no << ")\n";
     // check if valid block number
     if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+        std::cout << "Disk::read - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
+    uint64_t offset = (uint64_t)block_no * block_size;
+    if (backend == DISK_MMAP)
+    {
+        std::memcpy(blk, map + offset, block_size);
+        return 0;
+    }
+    if (backend == DISK_PREAD)
+        return pread(fd, blk, block_size, offset) == (ssize_t)block_size ? 0 : -1;
     diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    diskfile.read((char*)blk, block_size);
+    return 0;
+}
+
+// returns the length of the run of consecutive block numbers starting at
+// block_nos[first], the run never extends to index end or beyond
+size_t block_run_length(const std::vector<unsigned>& block_nos, size_t first, size_t end)
+{
+    size_t n = 1;
+    while (first + n < end && block_nos[first + n] == block_nos[first] + n)
+        n++;
+    return n;
+}
+
+// reads block_nos[i] into blks[i], one call per physically contiguous run
+int Disk::read_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks)
+{
+    for (auto block_no : block_nos)
+    {
+        if (block_no >= no_blocks)
+        {
+            std::cout << "Disk::read_blocks - ERROR: Invalid block number (" << block_no << ")\n";
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < block_nos.size();)
+    {
+        // a run is capped so it fits in one preadv/pwritev call
+        size_t n = block_run_length(block_nos, i, std::min(block_nos.size(), i + IOV_MAX));
+        uint64_t offset = (uint64_t)block_nos[i] * block_size;
+        if (DEBUG)
+            std::cout << "Disk::read_blocks(" << block_nos[i] << ", " << n << ")\n";
+        if (backend == DISK_MMAP)
+        {
+            for (size_t j = 0; j < n; j++)
+                std::memcpy(blks[i + j], map + offset + (uint64_t)j * block_size, block_size);
+        }
+        else if (backend == DISK_PREAD)
+        {
+            struct iovec iov[IOV_MAX];
+            for (size_t j = 0; j < n; j++)
+            {
+                iov[j].iov_base = blks[i + j];
+                iov[j].iov_len = block_size;
+            }
+            if (preadv(fd, iov, n, offset) != (ssize_t)(n * block_size))
+                return -1;
+        }
+        else
+        {
+            // one seek per run, the stream then reads the blocks in order
+            diskfile.seekg(offset, std::ios_base::beg);
+            for (size_t j = 0; j < n; j++)
+                diskfile.read((char*)blks[i + j], block_size);
+        }
+        i += n;
+    }
+    return 0;
+}
+
+// writes blks[i] to block_nos[i], one call per physically contiguous run
+int Disk::write_blocks(const std::vector<unsigned>& block_nos, const std::vector<const uint8_t*>& blks)
+{
+    for (auto block_no : block_nos)
+    {
+        if (block_no >= no_blocks)
+        {
+            std::cout << "Disk::write_blocks - ERROR: Invalid block number (" << block_no << ")\n";
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < block_nos.size();)
+    {
+        // a run is capped so it fits in one preadv/pwritev call
+        size_t n = block_run_length(block_nos, i, std::min(block_nos.size(), i + IOV_MAX));
+        uint64_t offset = (uint64_t)block_nos[i] * block_size;
+        if (DEBUG)
+            std::cout << "Disk::write_blocks(" << block_nos[i] << ", " << n << ")\n";
+        if (backend == DISK_MMAP)
+        {
+            for (size_t j = 0; j < n; j++)
+                std::memcpy(map + offset + (uint64_t)j * block_size, blks[i + j], block_size);
+        }
+        else if (backend == DISK_PREAD)
+        {
+            struct iovec iov[IOV_MAX];
+            for (size_t j = 0; j < n; j++)
+            {
+                iov[j].iov_base = (void*)blks[i + j];
+                iov[j].iov_len = block_size;
+            }
+            if (pwritev(fd, iov, n, offset) != (ssize_t)(n * block_size))
+                return -1;
+        }
+        else
+        {
+            // one seek and one flush per run
+            diskfile.seekp(offset, std::ios_base::beg);
+            for (size_t j = 0; j < n; j++)
+                diskfile.write((const char*)blks[i + j], block_size);
+            diskfile.flush();
+        }
+        i += n;
+    }
     return 0;
 }
+
+// borrows one block straight from the backing store without copying it,
+// returns nullptr if the backend has no addressable storage (fstream)
+const uint8_t* Disk::view(unsigned block_no)
+{
+    if (backend != DISK_MMAP)
+        return nullptr;
+    if (block_no >= no_blocks)
+    {
+        std::cout << "Disk::view - ERROR: Invalid block number (" << block_no << ")\n";
+        return nullptr;
+    }
+    return map + (uint64_t)block_no * block_size;
+}
+
+// makes all written blocks durable in the disk file
+int Disk::sync()
+{
+    if (backend == DISK_MMAP)
+        return msync(map, disk_size, MS_SYNC) == -1 ? -1 : 0;
+    if (backend == DISK_PREAD)
+        return fdatasync(fd) == -1 ? -1 : 0;
+    diskfile.flush();
+    return diskfile.good() ? 0 : -1;
+}
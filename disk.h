@@ -1,29 +1,67 @@
 #include <iostream>
 #include <fstream>
+#include <cstdint>
+#include <vector>
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
-#define BLOCK_SIZE 4096
+// geometry of a new disk file, the file system may choose another one
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_NO_BLOCKS 2048
 #define DEBUG false
 
+// disk backends, selected when the disk is constructed
+#define DISK_FSTREAM 0 // seek/read/write/flush on a std::fstream
+#define DISK_MMAP 1 // memcpy into a shared mapping of the disk file, msync on sync()
+#define DISK_PREAD 2 // pread/pwrite, preadv/pwritev for contiguous runs, fdatasync on sync()
+
 class Disk
 {
 private:
+    int backend;
     std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    int fd;
+    uint8_t* map;
+    unsigned block_size;
+    unsigned no_blocks;
+    uint64_t disk_size;
     bool disk_file_exists(const std::string& name);
+    bool open_disk_file();
+    void close_disk_file();
 public:
-    Disk();
+    Disk(int backend = DISK_FSTREAM);
     ~Disk();
+    int get_backend() { return backend; }
+    unsigned get_block_size() { return block_size; }
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    uint64_t get_disk_size() { return disk_size; }
+    // changes the block size and number of blocks, the disk file is resized
+    // to fit them exactly
+    int set_geometry(unsigned block_size, unsigned no_blocks);
+    // zeroes the whole disk without writing it, the blocks are punched out
+    // of the disk file, or it is truncated and grown again, so it is sparse
+    int discard();
     // writes one block to the disk
-    int write(unsigned block_no, uint8_t* blk);
+    int write(unsigned block_no, const uint8_t* blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t* blk);
+    // reads block_nos[i] into blks[i], physically contiguous runs of blocks
+    // are transferred with a single call
+    int read_blocks(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks);
+    // writes blks[i] to block_nos[i], physically contiguous runs of blocks
+    // are transferred with a single call
+    int write_blocks(const std::vector<unsigned>& block_nos, const std::vector<const uint8_t*>& blks);
+    // borrows one block straight from the backing store without copying it,
+    // returns nullptr if the backend has no addressable storage (fstream)
+    const uint8_t* view(unsigned block_no);
+    // makes all written blocks durable in the disk file
+    int sync();
 };
 
+// returns the length of the run of consecutive block numbers starting at
+// block_nos[first], the run never extends to index end or beyond
+size_t block_run_length(const std::vector<unsigned>& block_nos, size_t first, size_t end);
+
 #endif // __DISK_H__
@@ -0,0 +1,118 @@
+#include "freemap.h"
+
+FreeMap::FreeMap() : no_blocks(0), free_blocks(0)
+{
+}
+
+// sizes the map for no_blocks blocks, all of them in use
+void FreeMap::reset(unsigned no_blocks)
+{
+    this->no_blocks = no_blocks;
+    free_blocks = 0;
+    levels.clear();
+    // add levels until one word summarizes the whole map
+    size_t bits = no_blocks;
+    do
+    {
+        levels.push_back(std::vector<uint64_t>((bits + 63) / 64, 0));
+        bits = levels.back().size();
+    } while (bits > 1);
+}
+
+// marks block_no as free
+void FreeMap::release(unsigned block_no)
+{
+    if (block_no >= no_blocks || is_free(block_no))
+        return;
+    free_blocks++;
+    uint64_t pos = block_no;
+    for (size_t l = 0; l < levels.size(); l++)
+    {
+        uint64_t& word = levels[l][pos / 64];
+        bool was_empty = word == 0;
+        word |= 1ULL << (pos % 64);
+        // the levels above already know this word has a free block
+        if (!was_empty)
+            break;
+        pos /= 64;
+    }
+}
+
+// marks block_no as in use
+void FreeMap::reserve(unsigned block_no)
+{
+    if (block_no >= no_blocks || !is_free(block_no))
+        return;
+    free_blocks--;
+    uint64_t pos = block_no;
+    for (size_t l = 0; l < levels.size(); l++)
+    {
+        uint64_t& word = levels[l][pos / 64];
+        word &= ~(1ULL << (pos % 64));
+        // the levels above only change when the last free bit is cleared
+        if (word != 0)
+            break;
+        pos /= 64;
+    }
+}
+
+bool FreeMap::is_free(unsigned block_no)
+{
+    if (block_no >= no_blocks)
+        return false;
+    return (levels[0][block_no / 64] >> (block_no % 64)) & 1;
+}
+
+// returns the first set bit at or after pos in the given level, or -1
+int64_t FreeMap::find_set(size_t level, uint64_t pos)
+{
+    const std::vector<uint64_t>& words = levels[level];
+    uint64_t w = pos / 64;
+    if (w >= words.size())
+        return -1;
+    uint64_t rest = words[w] & (~0ULL << (pos % 64));
+    if (rest != 0)
+        return w * 64 + __builtin_ctzll(rest);
+    if (level + 1 == levels.size())
+    {
+        // the top level is a single word, nothing follows it
+        return -1;
+    }
+    // the level above tells which later word has a set bit
+    int64_t next = find_set(level + 1, w + 1);
+    if (next < 0)
+        return -1;
+    return next * 64 + __builtin_ctzll(words[next]);
+}
+
+// returns the first free block at or after start, or -1 if there is none
+int FreeMap::find_next(unsigned start)
+{
+    if (start >= no_blocks || free_blocks == 0)
+        return -1;
+    return find_set(0, start);
+}
+
+// returns the number of consecutive free blocks starting at start,
+// counting stops at max
+unsigned FreeMap::run_length(unsigned start, unsigned max)
+{
+    uint64_t n = 0;
+    uint64_t pos = start;
+    // whole words are skipped while they are free, blocks past the end
+    // of the map are never free so the run stops there
+    while (pos < no_blocks && n < max)
+    {
+        unsigned shift = pos % 64;
+        uint64_t used = ~levels[0][pos / 64] >> shift;
+        if (used == 0)
+        {
+            n += 64 - shift;
+            pos += 64 - shift;
+            continue;
+        }
+        n += __builtin_ctzll(used);
+        break;
+    }
+    return n < max ? n : max;
+}
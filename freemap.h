@@ -0,0 +1,42 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifndef __FREEMAP_H__
+#define __FREEMAP_H__
+
+// A hierarchical bitmap of the free blocks on the disk. Level 0 has one
+// bit per block, set if the block is free; a bit in each level above is
+// set if the 64-bit word below it has any bit set. Searching for a free
+// block descends the levels with one count-trailing-zeros per level, so
+// allocation and release take O(log64 n) and the free block count is
+// kept up to date without ever rescanning.
+class FreeMap
+{
+private:
+    std::vector<std::vector<uint64_t>> levels;
+    unsigned no_blocks;
+    unsigned free_blocks;
+
+    // returns the first set bit at or after pos in the given level, or -1
+    int64_t find_set(size_t level, uint64_t pos);
+public:
+    FreeMap();
+    // sizes the map for no_blocks blocks, all of them in use
+    void reset(unsigned no_blocks);
+    // marks block_no as free
+    void release(unsigned block_no);
+    // marks block_no as in use
+    void reserve(unsigned block_no);
+    bool is_free(unsigned block_no);
+    // returns the first free block at or after start, or -1 if there is none
+    int find_next(unsigned start);
+    // returns the number of consecutive free blocks starting at start,
+    // counting stops at max
+    unsigned run_length(unsigned start, unsigned max);
+
+    unsigned get_no_blocks() { return no_blocks; }
+    unsigned get_free() { return free_blocks; }
+};
+
+#endif // __FREEMAP_H__
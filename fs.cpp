@@ -1,47 +1,168 @@
 #include <iostream>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
 #include "fs.h"
 
-FS::FS()
+//The name of an entry, which fills the whole file_name field when it is 56 characters long.
+static std::string entry_name(const dir_entry& entry)
+{
+	return std::string(entry.file_name, strnlen(entry.file_name, sizeof(entry.file_name)));
+}
+
+//FNV-1a hash of len bytes, continuing from hash.
+static uint32_t fnv1a(const uint8_t* data, size_t len, uint32_t hash = 2166136261u)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+//FNV-1a hash of a name, it picks the bucket of the name in a hashed directory.
+static uint32_t name_hash(const std::string& name)
+{
+	return fnv1a((const uint8_t*)name.data(), name.size());
+}
+
+FS::FS(int backend, bool lazy) : disk(backend), cache(disk), meta_dirty(0), cow_gen(0), share_gen(1), dcache_hits(0), dcache_misses(0), next_fd(0), alloc_policy(ALLOC_NEXT_FIT), next_fit(0),
+	txn_depth(0), txn_ops(0), journal_seq(0), journal_commits(0), journal_group_ops(0), stopping(false), loading(false), load_failed(false), load_next(0)
 {
 	std::cout << "FS::FS()... Creating file system\n";
-	disk.read(FAT_BLOCK, (uint8_t*)fat);
 	path = "/";
+	if (mount(lazy))
+		std::cout << "No file system found on the disk, use format to create one.\n";
+	group_timer = std::thread([this]() { commit_timer(); });
 }
 
 FS::~FS()
 {
+	{
+		std::lock_guard<std::recursive_mutex> guard(mutex);
+		stopping = true;
+	}
+	group_cv.notify_one();
+	group_timer.join();
+	if (loader.joinable())
+		loader.join();
+	//Commit the pending directory sizes and everything that is still dirty in the block cache.
+	if (!load_failed)
+	{
+		flush_sizes();
+		journal_commit();
+	}
+	cache.sync();
 }
 
-// formats the disk, i.e., creates an empty file system
-int FS::format()
+// formats the disk, i.e., creates an empty file system with no_blocks
+// blocks of block_size bytes, 0 keeps the current geometry; the old
+// blocks are discarded, or overwritten with zeros if secure is set
+int FS::format(unsigned no_blocks, unsigned block_size, bool secure)
 {
-	//Set the whole disk to 0.
-	int nrBlocks = disk.get_no_blocks();
-	uint8_t zeroblob[BLOCK_SIZE] = { 0 };
-	for (int i = 0; i < nrBlocks; i++)
-		disk.write(i, zeroblob);
+	if (block_size == 0)
+		block_size = disk.get_block_size();
+	if (no_blocks == 0)
+		no_blocks = disk.get_no_blocks();
+
+	//The block size must be a power of two that fits a few directory entries.
+	if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)))
+	{
+		std::cerr << "Error! The block size must be a power of two between " << MIN_BLOCK_SIZE << " and " << MAX_BLOCK_SIZE << "." << std::endl;
+		return -1;
+	}
+	if (no_blocks < MIN_NO_BLOCKS || no_blocks > MAX_NO_BLOCKS)
+	{
+		std::cerr << "Error! The number of blocks must be between " << MIN_NO_BLOCKS << " and " << MAX_NO_BLOCKS << "." << std::endl;
+		return -1;
+	}
+
+	//Nothing cached from the old file system is valid anymore, and what a lazy mount has not read yet never will be.
+	loading = false;
+	load_failed = false;
+	cache.invalidate();
+	dcache.clear();
+	tails.clear();
+	size_deltas.clear();
+	journal_reset();
+	open_files.clear();
+	defrag = defrag_cursor();
+	if (disk.set_geometry(block_size, no_blocks))
+	{
+		std::cerr << "Error! Could not resize the disk." << std::endl;
+		return -1;
+	}
+
+	//Set the whole disk to 0. The blocks are normally dropped from the disk file, which reads back as zeros without
+	//writing anything. A secure format overwrites them with large writes, many of them in flight at once.
+	if (secure)
+	{
+		int nrBlocks = disk.get_no_blocks();
+		AsyncDisk& aio = async_disk();
+		std::vector<uint8_t> zeroblob((size_t)IO_BATCH_BLOCKS * block_size, 0);
+		for (int i = 0; i < nrBlocks; i += IO_BATCH_BLOCKS)
+			aio.write(i, std::min(IO_BATCH_BLOCKS, nrBlocks - i), zeroblob.data(), nullptr);
+		if (aio.wait() || disk.sync())
+		{
+			std::cerr << "Error! Could not clear the disk." << std::endl;
+			return -1;
+		}
+	}
+	else if (disk.discard())
+	{
+		std::cerr << "Error! Could not clear the disk." << std::endl;
+		return -1;
+	}
+
+	//The superblock is followed by the FAT, the journal, the reference counts and the root directory.
+	sb.magic = FS_MAGIC;
+	sb.version = FS_VERSION;
+	sb.block_size = block_size;
+	sb.no_blocks = no_blocks;
+	sb.fat_block = SUPER_BLOCK + 1;
+	sb.fat_blocks = (no_blocks + fat_entries() - 1) / fat_entries();
+	sb.journal_block = sb.fat_block + sb.fat_blocks;
+	sb.journal_blocks = std::min(std::max(no_blocks / 64, (unsigned)JOURNAL_MIN_BLOCKS), (unsigned)JOURNAL_MAX_BLOCKS);
+	sb.ref_block = sb.journal_block + sb.journal_blocks;
+	sb.ref_blocks = (no_blocks + ref_entries() - 1) / ref_entries();
+	sb.root_block = sb.ref_block + sb.ref_blocks;
+	if (sb.root_block >= no_blocks)
+	{
+		std::cerr << "Error! The disk is too small for the file system." << std::endl;
+		return -1;
+	}
 
 	//Configure root direcotry block
 	std::string name("/");
-	uint8_t blob[BLOCK_SIZE] = { 0 };
-	dir_entry* root = (dir_entry*)blob;
+	std::vector<uint8_t> blob(block_size, 0);
+	dir_entry* root = (dir_entry*)blob.data();
 	root->access_rights = READ | WRITE | EXECUTE;
 	name.copy(root->file_name, name.size());
-	root->first_blk = ROOT_BLOCK;
+	root->first_blk = sb.root_block;
 	root->size = 0;
 	root->type = TYPE_DIR;
 
-	//Mark root dir and FAT as EOF in the FAT
-	fat[0] = FAT_EOF;
-	fat[1] = FAT_EOF;
-
-	//Mark rest of blocks as FAT_FREE
-	for (int i = 2; i < nrBlocks; i++)
-		fat[i] = FAT_FREE;
+	//Mark the superblock, FAT, journal, reference counts and root dir as EOF and the rest of blocks as FAT_FREE in
+	//the FAT. The disk is already zeroed, so only the FAT blocks holding these entries have to be written.
+	fat.assign((size_t)sb.fat_blocks * fat_entries(), FAT_FREE);
+	fat_loaded.assign(sb.fat_blocks, true);
+	fat_dirty.assign(sb.fat_blocks, false);
+	refs.assign((size_t)sb.ref_blocks * ref_entries(), 0);
+	ref_dirty.assign(sb.ref_blocks, false);
+	meta_dirty = 0;
+	build_free_map();
+	for (unsigned i = 0; i <= sb.root_block; i++)
+		set_fat(i, FAT_EOF);
+	next_fit = 0;
 
 	//Write blocks to disk
-	disk.write(ROOT_BLOCK, (uint8_t*)root);
-	disk.write(FAT_BLOCK, (uint8_t*)fat);
+	std::vector<uint8_t> superblk(block_size, 0);
+	memcpy(superblk.data(), &sb, sizeof(sb));
+	meta_write(SUPER_BLOCK, superblk.data());
+	dir_init(sb.root_block, *root);
+	write_fat();
+	journal_commit();
 
 	path = "/";
 
@@ -52,221 +173,409 @@ int FS::format()
 // written on the following rows (ended with an empty row)
 int FS::create(std::string filepath)
 {
-	//Check if the filepath entered already exists.
-	if (find_dir_entry(filepath).file_name[0] != '\0')
+	//Read input from the user a line at a time, the lines keep their newlines.
+	std::string line;
+	size_t pos = 0;
+	bool ended = false;
+	return create_from(filepath, [&](uint8_t* buf, size_t len) -> int64_t
 	{
-		std::cerr << "Error! That file or directory already exists." << std::endl;
-		return -1;
-	}
+		size_t n = 0;
+		while (n < len && !ended)
+		{
+			if (pos == line.size())
+			{
+				if (!getline(std::cin, line) || line.empty())
+				{
+					ended = true;
+					break;
+				}
+				line += '\n';
+				pos = 0;
+			}
+			size_t part = std::min(len - n, line.size() - pos);
+			memcpy(buf + n, line.data() + pos, part);
+			n += part;
+			pos += part;
+		}
+		return n;
+	});
+}
 
-	//Read input from user.
-	std::string input = "", result = "";
-	while (getline(std::cin, input) and !input.empty())
-		result += input;
+// create <filepath> <in> creates a new file with the data of the stream
+int FS::create(std::string filepath, std::istream& in)
+{
+	return create_from(filepath, [&](uint8_t* buf, size_t len) -> int64_t
+	{
+		in.read((char*)buf, len);
+		if (in.bad())
+			return -1;
+		return in.gcount();
+	});
+}
 
-	//Calculate how many blocks will be needed for the string.
-	size_t numBlocks = std::ceil((float)result.size() / (float)BLOCK_SIZE);
-	std::vector<int> empty_spots(numBlocks);
-	char strblock[BLOCK_SIZE] = { 0 };
+// create <filepath> <fd> creates a new file with the data read from the host file descriptor
+int FS::create(std::string filepath, int fd)
+{
+	return create_from(filepath, [&](uint8_t* buf, size_t len) -> int64_t
+	{
+		ssize_t n;
+		do
+			n = ::read(fd, buf, len);
+		while (n < 0 && errno == EINTR);
+		return n;
+	});
+}
 
-	//If the string is smaller than the block size it is all put in one block.
-	if (numBlocks <= 1)
+// cat <filepath> reads the content of a file and prints it on the screen
+int FS::cat(std::string filepath)
+{
+	dir_entry entry = find_dir_entry(filepath); //Get the dir entry for the filepath entered.
+	if (entry.file_name[0] == '\0')
 	{
-		//Find an empty spot in the FAT for the new file.
-		empty_spots[0] = this->find_empty();
-		if (empty_spots[0] == -1)
-		{
-			std::cerr << "ERROR! No empty spots in the FAT." << std::endl;
-			return -1;
-		}
+		std::cerr << "Error! File does not exist." << std::endl;
+		return 1;
+	}
+	if (entry.type == 1)
+	{
+		std::cerr << "Error! That is a directory!" << std::endl;
+		return -1;
+	}
+	std::cout.flush();
+	int64_t n = copy_out(filepath, STDOUT_FILENO);
+	std::cout << std::endl;
+	return n < 0 ? -1 : 0;
+}
 
-		//Write the data to the disk.
-		result.copy(strblock, BLOCK_SIZE);
-		disk.write(empty_spots[0], (uint8_t*)strblock);
+// open <filepath> returns a handle for the file, with mode the access
+// rights (READ, WRITE) it is opened with, or -1
+int FS::open(std::string filepath, int mode)
+{
+	std::vector<dir_entry> chain;
+	if (resolve(filepath, chain) || chain.size() < 2)
+	{
+		std::cerr << "Error! File does not exist." << std::endl;
+		return -1;
 	}
-	//Split the string in to BLOCK_SIZE big parts if the string is bigger than one BLOCK_SIZE and write to disk.
-	else
+	if (chain.back().type == TYPE_DIR)
 	{
-		//Find enough empty spots in the FAT for the new file.
-		empty_spots = find_multiple_empty(numBlocks);
-		if (empty_spots[0] == -1)
-		{
-			std::cerr << "ERROR! Not enough empty spots in the FAT." << std::endl;
-			return -1;
-		}
+		std::cerr << "Error! That is a directory!" << std::endl;
+		return -1;
+	}
+	if ((chain.back().access_rights & mode) != mode)
+	{
+		std::cerr << "Error! You do not have access rights to open that file." << std::endl;
+		return -1;
+	}
+	int fd = next_fd++;
+	open_file& file = open_files[fd];
+	file.dir_blk = chain[chain.size() - 2].first_blk;
+	file.entry = chain.back();
+	file.mode = mode;
+	file.chain.swap(chain);
+	file.gen = cow_gen;
+	return fd;
+}
 
-		//Copy string to strblock while the amount of copied characters is BLOCK_SIZE.
-		size_t i = 0, j = 0;
-		while (result.copy(strblock, BLOCK_SIZE, i) == BLOCK_SIZE)
+//Returns the last block of the chain starting at first_blk, or -1 if the chain is broken. Recently appended files
+//remember it, so only the blocks added since are followed.
+int FS::tail_block(uint32_t first_blk)
+{
+	auto it = tails.find(first_blk);
+	int block_no = it != tails.end() ? it->second.block : first_blk;
+	for (unsigned steps = 0; fat[block_no] != FAT_EOF; steps++)
+	{
+		block_no = fat[block_no];
+		if ((unsigned)block_no <= sb.root_block || (unsigned)block_no >= sb.no_blocks || steps >= sb.no_blocks)
 		{
-			disk.write(empty_spots[j], (uint8_t*)strblock);
-			i += BLOCK_SIZE;
-			j++;
-			memset(strblock, '\0', BLOCK_SIZE);
+			std::cerr << "Error! The file's FAT chain is broken." << std::endl;
+			return -1;
 		}
-
-		//Write last block of the file to disk.
-		disk.write(empty_spots[j], (uint8_t*)strblock);
 	}
-	dir_entry currentDir;
+	if (it == tails.end() && tails.size() >= TAIL_CACHE_FILES)
+		tails.clear();
+	tails[first_blk].block = block_no;
+	return block_no;
+}
 
-	//Check if there is a slash in the filepath
-	//If there is not, the current path is fine.
-	if (filepath.find('/') == std::string::npos)
-		currentDir = find_dir_entry(this->path);
+//Looks up the entry of an open file again, a file that was moved to other blocks, truncated or had shared blocks
+//copied is indexed again.
+int FS::refresh(open_file& file)
+{
+	dentry* d = lookup(file.dir_blk, entry_name(file.entry));
+	if (d == nullptr || d->entry.type != TYPE_FILE)
+		return -1;
+	if (d->entry.first_blk != file.entry.first_blk || d->entry.size < file.entry.size || file.gen != cow_gen)
+		file.index.clear();
+	file.entry = d->entry;
+	file.gen = cow_gen;
+	return 0;
+}
 
-	//If there is a slash, remove the new file's name at the end of the filepath. Then put this path with only directories in tempPath.
-	else
+//Returns the block holding block k of the open file, or -1 past the end of its chain.
+//The chain is indexed as far as it has been used, every stride-th block, so any block is at most stride - 1 FAT hops
+//from the index. Small files index every block, larger ones just enough that the index stays below FILE_INDEX_BLOCKS.
+int FS::file_block(open_file& file, uint64_t k)
+{
+	if (file.index.empty())
+	{
+		uint64_t blocks = ((uint64_t)file.entry.size + sb.block_size - 1) / sb.block_size;
+		file.stride = 1;
+		while (blocks / file.stride >= FILE_INDEX_BLOCKS)
+			file.stride *= 2;
+		file.index.push_back(file.entry.first_blk);
+		file.indexed = 1;
+		file.last = file.entry.first_blk;
+	}
+	//Extend the index along the chain until it reaches block k.
+	while (file.indexed <= k)
 	{
-		std::string tempPath = filepath;
-		while (tempPath.back() != '/')
-			tempPath.pop_back();
-		currentDir = find_dir_entry(tempPath);
+		int32_t next = fat_at(file.last);
+		if (next <= 0 || (unsigned)next >= sb.no_blocks)
+			return -1;
+		file.last = next;
+		if (file.indexed % file.stride == 0)
+			file.index.push_back(next);
+		file.indexed++;
 	}
+	int block_no = file.index[k / file.stride];
+	for (uint64_t i = k % file.stride; i > 0; i--)
+		block_no = fat_at(block_no);
+	return block_no;
+}
 
-	//Get the name of the new file and put it in lastdir.
-	std::string lastdir = "";
-	size_t lastslash = filepath.find_last_of("/");
-	lastdir = filepath.substr(lastslash + 1, filepath.size() - lastslash);
+// read copies up to len bytes at offset of the open file to buf, returns
+// the number of bytes read, 0 at the end of the file, or -1
+int64_t FS::read(int fd, uint8_t* buf, size_t len, uint64_t offset)
+{
+	auto it = open_files.find(fd);
+	if (it == open_files.end() || !(it->second.mode & READ) || refresh(it->second))
+		return -1;
+	const dir_entry& entry = it->second.entry;
+	if (offset >= entry.size)
+		return 0;
+	len = std::min((uint64_t)len, entry.size - offset);
 
-	//Create the directory entry for the new file.
-	dir_entry fentry;
-	lastdir.copy(fentry.file_name, filepath.size());
+	//The index finds the block holding offset, the blocks after it follow in the FAT.
+	int block_no = file_block(it->second, offset / sb.block_size);
+	if (block_no == -1)
+		return -1;
 
-	fentry.access_rights = READ | WRITE | EXECUTE;
-	fentry.first_blk = empty_spots[0];
-	fentry.type = TYPE_FILE;
-	fentry.size = result.size();
+	//Each block is borrowed from the cache or the disk mapping and copied once, straight to buf.
+	size_t done = 0;
+	unsigned in_block = offset % sb.block_size;
+	while (done < len && block_no != FAT_EOF)
+	{
+		const uint8_t* block = cache.pin(block_no);
+		if (block == nullptr)
+			return -1;
+		size_t n = std::min(len - done, (size_t)(sb.block_size - in_block));
+		memcpy(buf + done, block + in_block, n);
+		cache.unpin(block_no);
+		done += n;
+		in_block = 0;
+		block_no = fat_at(block_no);
+		if (block_no == FAT_FREE)
+			return -1;
+	}
+	return done;
+}
 
-	//Update all the sizes in the hierarchy.
-	if (updateSize(fentry.size, filepath) == -1)
+// write copies len bytes from buf to offset of the open file, the file grows
+// if they go past its end and a gap before offset reads as zeros, returns
+// the number of bytes written or -1
+int64_t FS::write(int fd, const uint8_t* buf, size_t len, uint64_t offset)
+{
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
+
+	auto it = open_files.find(fd);
+	if (it == open_files.end() || !(it->second.mode & WRITE) || refresh(it->second))
+		return -1;
+	open_file& file = it->second;
+	uint64_t size = file.entry.size;
+	uint64_t end = offset + len;
+	if (end > UINT32_MAX)
 	{
-		std::cerr << "Error! Could not update the sizes." << std::endl;
+		std::cerr << "Error! The file would be too large." << std::endl;
 		return -1;
 	}
+	if (len == 0)
+		return 0;
 
-	//Read current dir block.
-	dir_entry* dirblock = (dir_entry*)strblock;
-	disk.read(currentDir.first_blk, (uint8_t*)dirblock);
+	//Blocks past the end of the chain are allocated, a file always has at least one block.
+	uint64_t have = std::max((uint64_t)1, (size + sb.block_size - 1) / sb.block_size);
 
-	//Find an empty spot for the new directory/file.
-	size_t k = 1;
-	while (dirblock[k].file_name[0] != '\0' && k < BLOCK_SIZE / sizeof(dir_entry))
-		k++;
+	//The blocks written to, and the last block when the chain grows, must not be shared.
+	if (unshare(file.dir_blk, file.entry, std::min(have - 1, (end - 1) / sb.block_size)) == -1)
+		return -1;
+	refresh(file);
+	uint64_t needed = std::max(have, (end + sb.block_size - 1) / sb.block_size);
+	std::vector<int> new_blocks;
+	if (needed > have)
+	{
+		new_blocks = find_multiple_empty(needed - have);
+		if (new_blocks[0] == -1)
+		{
+			std::cerr << "ERROR! Not enough empty spots in the FAT." << std::endl;
+			return -1;
+		}
+	}
 
-	//If there is no empty spot.
-	if (dirblock[k].file_name[0] != '\0')
+	//The bytes from the old end to offset are a hole, it is filled with zeros.
+	uint64_t from = std::min(offset, size);
+	std::vector<uint8_t> block(sb.block_size);
+	//A write that starts past the chain, at the end of a file with only full blocks, uses only new blocks.
+	int block_no = -1;
+	if (from / sb.block_size < have)
 	{
-		std::cerr << "ERROR! No more space for dir_entries in the current directory." << std::endl;
-		return -1;
+		block_no = file_block(file, from / sb.block_size);
+		if (block_no == -1)
+			return -1;
+	}
+	for (uint64_t k = from / sb.block_size; k * sb.block_size < end; k++)
+	{
+		if (k >= have)
+			block_no = new_blocks[k - have];
+		else if (k > from / sb.block_size)
+			block_no = fat[block_no];
+
+		//Only a block that is partly overwritten is read first.
+		uint64_t start = k * sb.block_size;
+		uint64_t lo = std::max(start, offset), hi = std::min(start + sb.block_size, end);
+		if (k >= have || (lo == start && hi == start + sb.block_size))
+			std::fill(block.begin(), block.end(), 0);
+		else if (cache.read(block_no, block.data()))
+			return -1;
+		for (uint64_t p = std::max(start, size); p < std::min(start + sb.block_size, offset); p++)
+			block[p - start] = 0;
+		if (lo < hi)
+			memcpy(block.data() + (lo - start), buf + (lo - offset), hi - lo);
+		if (cache.write(block_no, block.data()))
+			return -1;
 	}
-	//Put the new directory in the empty spot.
-	else
-		dirblock[k] = fentry;
 
-	//Update the FAT table so that it is consistent with the newly added file.
-	for (size_t i = 0; i < empty_spots.size(); i++)
+	//Link the new blocks to each other from the back, then to the end of the chain, and the file and its
+	//directories grow.
+	if (!new_blocks.empty())
 	{
-		if (i + 1 < numBlocks)
-			fat[empty_spots[i]] = empty_spots[i + 1];
-		else
-			fat[empty_spots[i]] = FAT_EOF;
+		for (size_t i = new_blocks.size(); i-- > 0;)
+		{
+			set_fat(new_blocks[i], i + 1 < new_blocks.size() ? new_blocks[i + 1] : FAT_EOF);
+			if (checkpoint())
+				return -1;
+		}
+		int last = file_block(file, have - 1);
+		if (last == -1)
+			return -1;
+		set_fat(last, new_blocks[0]);
+		write_fat();
+	}
+	if (end > size)
+	{
+		if (add_size(file.chain, end - size))
+			return -1;
+		file.entry.size = end;
 	}
+	return len;
+}
 
-	//Uppdate the FAT and current directory block ON THE DISK.
-	disk.write(FAT_BLOCK, (uint8_t*)fat);
-	disk.write(currentDir.first_blk, (uint8_t*)(dirblock));
-	return 0;
+// close releases a handle returned by open
+int FS::close(int fd)
+{
+	return open_files.erase(fd) ? 0 : -1;
 }
 
-// cat <filepath> reads the content of a file and prints it on the screen
-int FS::cat(std::string filepath)
+// import <hostpath> <filepath> creates a new file with the content of a file
+// on the host, and reports the throughput
+int FS::import_file(std::string hostpath, std::string filepath)
 {
-	dir_entry entry = find_dir_entry(filepath); //Get the dir entry for the filepath entered.
-	if (entry.file_name[0] == '\0')
+	int fd = ::open(hostpath.c_str(), O_RDONLY);
+	if (fd == -1)
 	{
-		std::cerr << "Error! File does not exist." << std::endl;
-		return 1;
+		std::cerr << "Error! Could not open " << hostpath << ": " << strerror(errno) << std::endl;
+		return -1;
 	}
-	if (entry.type == 1)
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	auto start = std::chrono::steady_clock::now();
+	int ret = create(filepath, fd);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	::close(fd);
+	if (ret)
+		return ret;
+	uint64_t bytes = find_dir_entry(filepath).size;
+	std::cout << "imported " << bytes << " bytes in " << seconds << " s, " << bytes / 1e6 / seconds << " MB/s" << std::endl;
+	return 0;
+}
+
+// export <filepath> <hostpath> copies the content of a file to a file on the
+// host, and reports the throughput
+int FS::export_file(std::string filepath, std::string hostpath)
+{
+	dir_entry entry = find_dir_entry(filepath);
+	if (entry.file_name[0] == '\0' || entry.type != TYPE_FILE)
 	{
-		std::cerr << "Error! That is a directory!" << std::endl;
+		std::cerr << "Error! File does not exist." << std::endl;
 		return -1;
 	}
-	if (!(entry.access_rights & READ))
+	int fd = ::open(hostpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
 	{
-		std::cerr << "Error! You do not have access rights to read that file." << std::endl;
+		std::cerr << "Error! Could not create " << hostpath << ": " << strerror(errno) << std::endl;
 		return -1;
 	}
 
-	uint8_t block[BLOCK_SIZE] = { 0 };
-	disk.read(entry.first_blk, block); //Read the first block.
-
-	//This for-loop will start on the first block of the file and jump to the next block which the file is occupying in the FAT until it reaches FAT_EOF.
-	for (int i = entry.first_blk; i != EOF; i = fat[i])
+	auto start = std::chrono::steady_clock::now();
+	int64_t bytes = copy_out(filepath, fd);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (::close(fd) || bytes < 0)
 	{
-		disk.read(i, block);
-		for (size_t i = 0; i < BLOCK_SIZE; i++)
-			std::cout << block[i];
+		std::cerr << "Error! Could not write " << hostpath << ": " << strerror(errno) << std::endl;
+		return -1;
 	}
-	std::cout << std::endl;
+	std::cout << "exported " << bytes << " bytes in " << seconds << " s, " << bytes / 1e6 / seconds << " MB/s" << std::endl;
 	return 0;
 }
 
 // ls lists the content in the currect directory (files and sub-directories)
 int FS::ls()
 {
-	//Read the current paths dir and block.
-	uint8_t buff[BLOCK_SIZE] = { 0 };
-	dir_entry* dirblock = (dir_entry*)buff;
-	dir_entry currentDir = find_dir_entry(this->path);
-	disk.read(currentDir.first_blk, (uint8_t*)dirblock);
-	dir_entry* file_entry = nullptr;
-	file_entry = dirblock; //Set the first file entry to be the start of the directory block.
-
-	//Check the access rights and construct the string.
-	std::string accessRights = "";
-	if (file_entry->access_rights & READ)
-		accessRights.append("r");
-	else
-		accessRights.append("-");
-
-	if (file_entry->access_rights & WRITE)
-		accessRights.append("w");
-	else
-		accessRights.append("-");
+	if (check_loaded())
+		return -1;
 
-	if (file_entry->access_rights & EXECUTE)
-		accessRights.append("x");
-	else
-		accessRights.append("-");
+	//Sizes are printed, so the pending ones are written first.
+	flush_sizes();
 
-	//Write out the current blocks content.
-	std::cout << file_entry->file_name << "\t" << (int)file_entry->type << "\t" << accessRights << "\t" << (int)file_entry->size << std::endl;
+	//Read the current paths dir and its entries, the first one is the directory itself or its parent.
+	std::vector<uint8_t> buff(sb.block_size, 0);
+	dir_entry* dirblock = (dir_entry*)buff.data();
+	dir_entry currentDir = find_dir_entry(this->path);
+	cache.read(currentDir.first_blk, (uint8_t*)dirblock);
+	std::vector<dir_entry> entries(1, dirblock[0]);
+	if (dir_list(currentDir.first_blk, entries))
+		return -1;
 
-	for (long unsigned int i = 1; i < BLOCK_SIZE / sizeof(dir_entry); i++)
+	for (auto& file_entry : entries)
 	{
-		accessRights = "";
-		file_entry++;
-		if (file_entry->file_name[0] != '\0')
-		{
-			if (file_entry->access_rights & READ)
-				accessRights.append("r");
-			else
-				accessRights.append("-");
+		//Check the access rights and construct the string.
+		std::string accessRights = "";
+		if (file_entry.access_rights & READ)
+			accessRights.append("r");
+		else
+			accessRights.append("-");
 
-			if (file_entry->access_rights & WRITE)
-				accessRights.append("w");
-			else
-				accessRights.append("-");
+		if (file_entry.access_rights & WRITE)
+			accessRights.append("w");
+		else
+			accessRights.append("-");
 
-			if (file_entry->access_rights & EXECUTE)
-				accessRights.append("x");
-			else
-				accessRights.append("-");
+		if (file_entry.access_rights & EXECUTE)
+			accessRights.append("x");
+		else
+			accessRights.append("-");
 
-			std::cout << file_entry->file_name << "\t" << (int)file_entry->type << "\t" << accessRights << "\t" << (int)file_entry->size << std::endl;
-		}
+		std::cout << entry_name(file_entry) << "\t" << (int)file_entry.type << "\t" << accessRights << "\t" << (int)file_entry.size << std::endl;
 	}
 	return 0;
 }
@@ -275,6 +584,10 @@ int FS::ls()
 // <sourcefilepath> to a new file <destfilepath>
 int FS::cp(std::string sourcefilepath, std::string destfilepath)
 {
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
+
 	//Find the dir_entry for the source.
 	dir_entry sourceDir = find_dir_entry(sourcefilepath);
 	if (sourceDir.file_name[0] == '\0')
@@ -295,12 +608,32 @@ int FS::cp(std::string sourcefilepath, std::string destfilepath)
 		return -1;
 	}
 
-	//Calculate the number of blocks that the source occupies.
-	size_t nrBlocks = std::ceil((float)sourceDir.size / (float)BLOCK_SIZE);
+	//If the destination path is a relative path, make it absolute.
+	if (destfilepath[0] != '/')
+		destfilepath = path + destfilepath;
+
+	//Get the name of the destination file, if there is a slash in the destfilepath.
+	std::string temppath = destfilepath;
+	temppath = destfilepath.substr(destfilepath.find_last_of('/') + 1, destfilepath.length() - 1);
+	destfilepath.erase(destfilepath.find_last_of('/') + 1);
+
+	std::vector<dir_entry> parents;
+	if (resolve(destfilepath, parents) || parents.back().type != TYPE_DIR)
+	{
+		std::cerr << "Error! The destination directory does not exist." << std::endl;
+		return -1;
+	}
+	dir_entry currentDir = parents.back();
+
+	//Calculate the number of blocks that the source occupies, an empty file still has one.
+	size_t nrBlocks = std::max((size_t)1, (size_t)std::ceil((float)sourceDir.size / (float)sb.block_size));
 	std::vector<int> empty_spots(nrBlocks);
-	int dataSize = 0;
+	//The copy shares the blocks of the source when the file system counts references, no data is copied.
+	bool share = !refs.empty() && refs[sourceDir.first_blk] < REF_MAX;
+	if (share)
+		empty_spots.clear();
 	//If it just occupies one or zero blocks.
-	if (nrBlocks == 1)
+	else if (nrBlocks == 1)
 	{
 		//Find one empty spot.
 		empty_spots[0] = find_empty();
@@ -310,16 +643,12 @@ int FS::cp(std::string sourcefilepath, std::string destfilepath)
 			return -1;
 		}
 
-		//Read the source data from the disk.
-		uint8_t sourceBlock[BLOCK_SIZE] = { 0 };
-		disk.read(sourceDir.first_blk, sourceBlock);
-		std::string s((char*)sourceBlock);
-
-		//Add the size of the block to the dataSize
-		dataSize += s.length();
-
-		//Write the data to the disk in the new destination.
-		disk.write(empty_spots[0], sourceBlock);
+		//Borrow the source block and write it to the new destination.
+		const uint8_t* sourceBlock = cache.pin(sourceDir.first_blk);
+		if (sourceBlock == nullptr)
+			return -1;
+		cache.write(empty_spots[0], sourceBlock);
+		cache.unpin(sourceDir.first_blk);
 	}
 	else if (nrBlocks != 0) //If the file data occupies more than 1 block.
 	{
@@ -330,85 +659,91 @@ int FS::cp(std::string sourcefilepath, std::string destfilepath)
 			return -1;
 		}
 
-		uint8_t sourceBlock[BLOCK_SIZE] = { 0 };
 		int fatNr = sourceDir.first_blk;
+		AsyncDisk& aio = async_disk();
 
-		//Write over all the data to the found free blocks.
-		size_t i = 0;
-		while (i < nrBlocks)
+		//Copy the data in batches with many requests in flight, the disk is read and written around the cache.
+		std::vector<uint8_t> buffer(std::min(nrBlocks, (size_t)IO_BATCH_BLOCKS) * sb.block_size);
+		for (size_t i = 0; i < nrBlocks; i += IO_BATCH_BLOCKS)
 		{
-			disk.read(fatNr, sourceBlock);
-			std::string s((char*)sourceBlock);
-
-			if (i != nrBlocks - 1)
-				s.pop_back(); //Remove weird null character
-
-			//Add the size of the block to the dataSize
-			dataSize += s.size();
-			disk.write(empty_spots[i], sourceBlock);
-			memset(sourceBlock, '\0', BLOCK_SIZE);
-			fatNr = fat[fatNr];
-			i++;
+			size_t n = std::min(nrBlocks - i, (size_t)IO_BATCH_BLOCKS);
+			std::vector<unsigned> source_nos, dest_nos;
+			for (size_t j = 0; j < n; j++, fatNr = fat[fatNr])
+			{
+				source_nos.push_back(fatNr);
+				dest_nos.push_back(empty_spots[i + j]);
+			}
+			//Dirty source blocks must reach the disk before it is read around the cache.
+			cache.writeback(source_nos);
+
+			//Every contiguous source run is read with one request, and when it completes its data is written with one request per contiguous destination run.
+			for (size_t j = 0; j < n;)
+			{
+				size_t len = block_run_length(source_nos, j, n);
+				uint8_t* data = buffer.data() + j * sb.block_size;
+				unsigned block_size = sb.block_size;
+				aio.read(source_nos[j], len, data, [&aio, &dest_nos, data, j, len, block_size](int result)
+				{
+					if (result)
+						return;
+					for (size_t k = j; k < j + len;)
+					{
+						size_t dlen = block_run_length(dest_nos, k, j + len);
+						aio.write(dest_nos[k], dlen, data + (k - j) * block_size, nullptr);
+						k += dlen;
+					}
+				});
+				j += len;
+			}
+			int ret = aio.wait();
+			//Cached copies of the destination blocks are stale now.
+			cache.discard(dest_nos);
+			if (ret)
+			{
+				std::cerr << "ERROR! Could not copy the file data." << std::endl;
+				return -1;
+			}
 		}
 	}
 
-	//If the destination path is a relative path, make it absolute.
-	if (destfilepath[0] != '/')
-		destfilepath = path + destfilepath;
-
-	//Get the name of the destination file, if there is a slash in the destfilepath.
-	std::string temppath = destfilepath;
-	temppath = destfilepath.substr(destfilepath.find_last_of('/') + 1, destfilepath.length() - 1);
-	destfilepath.erase(destfilepath.find_last_of('/'), destfilepath.length() - 1);
-
-	dir_entry currentDir = find_dir_entry(destfilepath);
-
 	//Create the directory entry for the new file.
 	dir_entry fentry;
-	temppath.copy(fentry.file_name, temppath.size());
+	temppath.copy(fentry.file_name, sizeof(fentry.file_name));
 	fentry.access_rights = READ | WRITE | EXECUTE;
-	fentry.first_blk = empty_spots[0];
+	fentry.first_blk = share ? sourceDir.first_blk : empty_spots[0];
 	fentry.type = TYPE_FILE;
-	fentry.size = dataSize;
+	fentry.size = sourceDir.size;
 
-	//Update folders sizes.
-	if (updateSize(fentry.size, destfilepath) == -1)
+	//Update the FAT table so that it is consistent with the newly added file.
+	//This comes first, so a directory that grows cannot take the file's blocks. The chain is linked from the back
+	//and no entry reaches it yet, so the group may be committed on the way.
+	for (size_t i = empty_spots.size(); i-- > 0;)
 	{
-		std::cerr << "Error! Could not update the sizes." << std::endl;
-		return -1;
+		if (i + 1 < nrBlocks)
+			set_fat(empty_spots[i], empty_spots[i + 1]);
+		else
+			set_fat(empty_spots[i], FAT_EOF);
+		if (checkpoint())
+			return -1;
 	}
 
-	//Read current directory block.
-	uint8_t buff[BLOCK_SIZE] = { 0 };
-	dir_entry* dirblock = (dir_entry*)buff;
-	disk.read(currentDir.first_blk, (uint8_t*)dirblock);
-
-	//Find an empty spot for the new directory.
-	size_t k = 1;
-	while (dirblock[k].file_name[0] != '\0' && k < BLOCK_SIZE / sizeof(dir_entry)) //Fel antal
-		k++;
-
-	//If there is no empty spot.
-	if (dirblock[k].file_name[0] != '\0')
+	//Put the new file in the destination directory.
+	if (dir_insert(currentDir.first_blk, fentry))
 	{
 		std::cerr << "ERROR! No more space for dir_entries in the current block." << std::endl;
+		for (auto block_no : empty_spots)
+			set_fat(block_no, FAT_FREE);
+		write_fat();
 		return -1;
 	}
-	else //Put the new directory in the empty spot.
-		dirblock[k] = fentry;
+	if (share)
+		set_ref(sourceDir.first_blk, refs[sourceDir.first_blk] + 1);
 
-	//Update the FAT table so that it is consistent with the newly added file.
-	for (size_t i = 0; i < empty_spots.size(); i++)
-	{
-		if (i + 1 < nrBlocks)
-			fat[empty_spots[i]] = empty_spots[i + 1];
-		else
-			fat[empty_spots[i]] = FAT_EOF;
-	}
+	//Update folders sizes.
+	add_size(parents, fentry.size);
 
-	//Uppdate the FAT and current directory block ON THE DISK.
-	disk.write(FAT_BLOCK, (uint8_t*)fat);
-	disk.write(currentDir.first_blk, (uint8_t*)dirblock);
+	//Uppdate the FAT ON THE DISK.
+	write_fat();
 	return 0;
 }
 
@@ -416,87 +751,107 @@ int FS::cp(std::string sourcefilepath, std::string destfilepath)
 // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
 int FS::mv(std::string sourcepath, std::string destpath)
 {
-	dir_entry currentDir;
-	destpath = path + destpath;
-	std::string tempPath = destpath;
-	while (destpath.back() != '/')
-		destpath.pop_back();
-
-	if (destpath.size() != 1)
-		destpath.pop_back();
-
-	dir_entry destDir = find_dir_entry(destpath);
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
 
-	currentDir = find_dir_entry(sourcepath);
-	if (currentDir.file_name[0] == '\0')
+	//The entries from the root down to the source file, the file itself is taken off the end.
+	std::vector<dir_entry> src_chain;
+	if (resolve(sourcepath, src_chain) || src_chain.size() < 2)
 	{
 		std::cerr << "Error! The source file does not exist!" << std::endl;
 		return -1;
 	}
-	if (currentDir.type == 1)
+	dir_entry moved = src_chain.back();
+	src_chain.pop_back();
+	if (moved.type == TYPE_DIR)
 	{
 		std::cerr << "Error! The source is a directory, not a file." << std::endl;
 		return -1;
 	}
+	std::string old_name = entry_name(moved);
 
-	if (destDir.type == 1) //Move if dest is a directory.
-	{
-		dir_entry tempDir = find_dir_entry(tempPath);
-		if (tempDir.file_name[0] != '\0')
-			rm(tempPath);
-		cp(sourcepath, tempPath);
-		rm(sourcepath);
-
-		return 0;
-	}
-	else if ((destDir.file_name[0] != '\0' && destDir.type == 0)) //OR if the name is taken and it is a file
+	//The destination is a directory to move the file into, or the new path of the file.
+	std::vector<dir_entry> dest_chain;
+	std::string name = old_name;
+	if (resolve(destpath, dest_chain) || dest_chain.back().type != TYPE_DIR)
 	{
-		rm(destpath);
-		cp(sourcepath, destpath);
-		rm(sourcepath);
-
-		return 0;
+		size_t lastslash = destpath.find_last_of('/');
+		name = destpath.substr(lastslash + 1);
+		if (resolve(lastslash == std::string::npos ? path : destpath.substr(0, lastslash + 1), dest_chain)
+			|| dest_chain.back().type != TYPE_DIR)
+		{
+			std::cerr << "Error! The destination directory does not exist." << std::endl;
+			return -1;
+		}
 	}
 
 	//If filename is too long
-	if (destpath.length() > 56)
+	if (name.empty() || name.length() > sizeof(moved.file_name))
 	{
 		std::cerr << "Error! New filename is too long!" << std::endl;
 		return -1;
 	}
+	unsigned src_blk = src_chain.back().first_blk;
+	unsigned dest_blk = dest_chain.back().first_blk;
+	if (src_blk == dest_blk && name == old_name)
+		return 0;
 
-	//Read current block.
-	uint8_t buff[BLOCK_SIZE] = { 0 };
-	dir_entry* dirblock = (dir_entry*)buff;
-
-	//If the path is relative, make it absolute.
-	if (sourcepath[0] != '/')
-		sourcepath = path + sourcepath;
-
-	//Get the name of the file, if what was entered was a path.
-	std::string temppath = sourcepath.substr(sourcepath.find_last_of('/') + 1, sourcepath.length() - 1);
-	sourcepath.erase(sourcepath.find_last_of('/'), sourcepath.length() - 1);
-	currentDir = find_dir_entry(sourcepath);
-	disk.read(currentDir.first_blk, buff);
-
-	//Find the spot where the dir is.
-	int i = 0;
-	while (temppath.compare(dirblock->file_name) && i < std::floor(BLOCK_SIZE / sizeof(dir_entry)))
+	//A file with the new name is replaced, a directory is not.
+	const dentry* existing = lookup(dest_blk, name);
+	if (existing != nullptr)
 	{
-		i++;
-		dirblock++;
-	}
-	//Change the dir name and write it back to disk.
-	memset(dirblock->file_name, 0, 56);
-	destpath.copy(dirblock->file_name, 56);
-	disk.write(currentDir.first_blk, (uint8_t*)buff);
+		if (existing->entry.type == TYPE_DIR)
+		{
+			std::cerr << "Error! The destination is a directory." << std::endl;
+			return -1;
+		}
+		dir_entry replaced = existing->entry;
+		if (dir_remove(dest_blk, name))
+			return -1;
+		add_size(dest_chain, -(int64_t)replaced.size);
+		release_chain(replaced.first_blk);
+		write_fat();
+	}
+
+	//Relink the entry, the file keeps its blocks and only the two directories are written. The new entry comes
+	//first, a directory that is rehashed for it may commit while the file is still in its old place.
+	dir_entry renamed = moved;
+	memset(renamed.file_name, 0, sizeof(renamed.file_name));
+	name.copy(renamed.file_name, sizeof(renamed.file_name));
+	if (dir_insert(dest_blk, renamed))
+	{
+		std::cerr << "ERROR! No more space for dir_entries in the destination directory." << std::endl;
+		return -1;
+	}
+	if (dir_remove(src_blk, old_name))
+		return -1;
+
+	//The sizes are deferred, so the directories both paths go through net out before anything is written.
+	add_size(src_chain, -(int64_t)moved.size);
+	add_size(dest_chain, moved.size);
+
+	//Open handles follow the file.
+	for (auto& it : open_files)
+	{
+		open_file& file = it.second;
+		if (file.dir_blk != src_blk || entry_name(file.entry) != old_name)
+			continue;
+		file.dir_blk = dest_blk;
+		file.entry = renamed;
+		file.chain = dest_chain;
+		file.chain.push_back(renamed);
+	}
 	return 0;
 }
 
 // rm <filepath> removes / deletes the file <filepath>
 int FS::rm(std::string filepath)
 {
-	uint8_t block[BLOCK_SIZE] = { 0 };
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
+
 	std::string temppath = "";
 
 	if (filepath[0] != '/') //Check if path is absolute.
@@ -509,52 +864,42 @@ int FS::rm(std::string filepath)
 	if (filepath.size() > 1)
 		filepath.pop_back();
 
-	dir_entry currentDir = find_dir_entry(filepath);
-	disk.read(currentDir.first_blk, block);
-
-	if (currentDir.file_name[0] == '\0')
+	//Pending sizes are written first, a removed directory's block can be reused.
+	flush_sizes();
+	std::vector<dir_entry> parents;
+	if (resolve(filepath, parents) || parents.back().type != TYPE_DIR)
 		return -1;
+	dir_entry currentDir = parents.back();
 
-	dir_entry* entry = nullptr;
-	size_t i = 0;
-	//Look for the dir_entry in current block.
-	for (dir_entry* it = (dir_entry*)block; temppath.compare(it->file_name); entry = ++it)
+	//Look for the dir_entry in the current directory.
+	const dentry* found = lookup(currentDir.first_blk, temppath);
+	if (found == nullptr)
 	{
-		if (i++ > std::floor(BLOCK_SIZE / sizeof(dir_entry)))
-		{
-			std::cerr << "Could not find file or directory on path: " << filepath << std::endl;
-			return 1;
-		}
+		std::cerr << "Could not find file or directory on path: " << filepath << std::endl;
+		return 1;
 	}
+	dir_entry entry = found->entry;
+
+	//The entry goes first, so a commit while the blocks are freed at worst leaves some of them allocated.
+	std::vector<unsigned> block_nos;
+	if (entry.type == TYPE_DIR)
+		dir_blocks(entry.first_blk, block_nos);
+	if (dir_remove(currentDir.first_blk, temppath))
+		return -1;
+	add_size(parents, -(int64_t)entry.size);
 
-	int save = 0;
-	for (int i = fat[entry->first_blk];; i = save)
+	//Free every block of the file that no other file shares, starting with the first one, or every block of the directory.
+	if (entry.type == TYPE_DIR)
 	{
-		if (i == EOF)
+		for (auto block_no : block_nos)
 		{
-			fat[save] = EOF;
-			break;
+			set_fat(block_no, FAT_FREE);
+			checkpoint();
 		}
-		save = fat[i];
-		fat[i] = FAT_FREE;
-		if (i == EOF)
-			break;
-	}
-
-	entry->access_rights = 0u;
-	for (size_t i = 0; i < 56; i++)
-		entry->file_name[i] = '\0';
-	entry->first_blk = 0u;
-	uint32_t tempSize = entry->size; //Save the size for the update function.
-	entry->size = 0u;
-	entry->type = 0u;
-	disk.write(currentDir.first_blk, block);
-
-	if (updateSize(-tempSize, filepath) == -1)
-	{
-		std::cerr << "Error! Could not update the sizes." << std::endl;
-		return -1;
 	}
+	else
+		release_chain(entry.first_blk);
+	write_fat();
 
 	return 0;
 }
@@ -563,89 +908,123 @@ int FS::rm(std::string filepath)
 // the end of file <filepath2>. The file <filepath1> is unchanged.
 int FS::append(std::string filepath1, std::string filepath2)
 {
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
+
+	//The entries from the root down to file2, its size and the sizes above it grow.
+	std::vector<dir_entry> chain2;
 	dir_entry entry1 = find_dir_entry(filepath1);
-	dir_entry entry2 = find_dir_entry(filepath2);
+	dir_entry entry2 = resolve(filepath2, chain2) ? dir_entry() : chain2.back();
 	if (entry1.file_name[0] == '\0' or entry2.file_name[0] == '\0')
 	{
 		std::cerr << "Path not valid." << std::endl;
 		return -1;
 	}
-	uint8_t file1[BLOCK_SIZE];
-	size_t binlastblock2 = entry2.size % BLOCK_SIZE;
-
-	size_t lastblockfree = BLOCK_SIZE - binlastblock2 - 1;
-	float diff = std::ceil(((float)entry1.size - (float)lastblockfree) / (float)BLOCK_SIZE);
-	size_t newblocksneeded = diff < 0 ? 0 : diff;
-	uint8_t file2[BLOCK_SIZE];
-	int lastfatfile2 = entry2.first_blk;
-	while (fat[lastfatfile2] != EOF) //Retrive the last block of a file.
-		lastfatfile2 = fat[lastfatfile2];
-	int originallastblock = lastfatfile2;
-	std::vector<int> zero;
-	zero.push_back(0);
-	auto empty = (newblocksneeded > 0) ? find_multiple_empty(newblocksneeded) : zero; //Find appropriate amount of needed empty blocks
-
-	if (newblocksneeded == 0)
-	{
-		disk.read(lastfatfile2, file2);
-		disk.read(entry1.first_blk, file1);
-		uint8_t* it1 = file1;
-		uint8_t* it2 = file2 + binlastblock2;						  //End of file2.
-		for (size_t i = 0; i <= entry1.size; i++, it2++, it1++) //Copy part of first block of file1 to lst block of file2.
-			*it2 = *it1;
-		disk.write(lastfatfile2, file2);
-
-		if (updateSize(entry1.size, filepath2) == -1) //Update the sizes after the move.
+	if (entry1.type == TYPE_DIR || entry2.type == TYPE_DIR)
+	{
+		std::cerr << "Error! Only files can be appended." << std::endl;
+		return -1;
+	}
+	uint64_t size1 = entry1.size, size2 = entry2.size;
+	if (size1 == 0)
+		return 0;
+	if (size1 + size2 > UINT32_MAX)
+	{
+		std::cerr << "Error! The file would be too large." << std::endl;
+		return -1;
+	}
+
+	//The last block of file2 and its link change, the blocks it shares with other files are copied first. A file
+	//that was found to own its chain is not walked again, until a block is shared somewhere.
+	auto known = tails.find(entry2.first_blk);
+	if ((known == tails.end() || known->second.owned != share_gen)
+		&& unshare(chain2[chain2.size() - 2].first_blk, entry2, UINT64_MAX) == -1)
+		return -1;
+	int tail = tail_block(entry2.first_blk);
+	if (tail == -1)
+		return -1;
+
+	//The data goes after the bytes in the last block of file2, then into new blocks taken as one run when there is one.
+	unsigned in_last = size2 == 0 ? 0 : (size2 - 1) % sb.block_size + 1;
+	uint64_t room = sb.block_size - in_last;
+	uint64_t newblocks = size1 > room ? (size1 - room + sb.block_size - 1) / sb.block_size : 0;
+	std::vector<int> empty;
+	if (newblocks > 0)
+	{
+		empty = find_multiple_empty(newblocks);
+		if (empty[0] == -1)
 		{
-			std::cerr << "Error! Could not update the sizes." << std::endl;
+			std::cerr << "ERROR! Not enough empty spots in the FAT." << std::endl;
 			return -1;
 		}
-		return 0;
 	}
-	else
+	std::vector<unsigned> targets;
+	if (room > 0)
+		targets.push_back(tail);
+	targets.insert(targets.end(), empty.begin(), empty.end());
+
+	//Copy file1 in batches of whole blocks, the first batch starts with what is in the last block of file2.
+	int fd = open(filepath1, READ);
+	if (fd == -1)
+		return -1;
+	std::vector<uint8_t> batch((size_t)IO_BATCH_BLOCKS * sb.block_size);
+	size_t fill = room > 0 ? in_last : 0;
+	if (fill > 0 && cache.read(tail, batch.data()))
+	{
+		close(fd);
+		return -1;
+	}
+	size_t next = 0;
+	for (uint64_t offset = 0; offset < size1;)
 	{
-		uint8_t* it1 = file1;					  // Copy block pointer (start)
-		uint8_t* it2 = file2 + binlastblock2; // File Endpoint
-		size_t file1blocktoread = entry1.first_blk;
-		size_t byteswandered = 0, i = 0;
-		size_t bytestocopy = lastblockfree;
-		disk.read(lastfatfile2, file2);
-		disk.read(entry1.first_blk, file1);
-		while (byteswandered < entry1.size)
+		int64_t n = read(fd, batch.data() + fill, std::min(batch.size() - fill, size1 - offset), offset);
+		if (n <= 0)
 		{
-			if (it1 == file1 + BLOCK_SIZE)
-			{
-				file1blocktoread = fat[file1blocktoread];
-				disk.read(file1blocktoread, file1);
-				it1 = file1;
-			}
-			if (file1blocktoread == (size_t)EOF)
-				bytestocopy = entry1.size - byteswandered;
-			else
-				bytestocopy = std::min((file1 + BLOCK_SIZE) - it1, (file2 + BLOCK_SIZE) - it2);
-
-			for (size_t i = 0; i < bytestocopy; i++, it2++, it1++, byteswandered++) //Copy part of first block of file1 to lst block of file2.
-				*it2 = *it1;
-
-			if (it2 == file2 + BLOCK_SIZE)
-			{
-				disk.write(lastfatfile2, file2);
-				for (size_t i = 0; i < BLOCK_SIZE; i++)
-					file2[i] = '\0';
-				lastfatfile2 = empty[i++];
-				it2 = file2;
-			}
+			close(fd);
+			std::cerr << "Error! Could not read " << filepath1 << "." << std::endl;
+			return -1;
+		}
+		offset += n;
+		fill += n;
+		if (fill < batch.size() && offset < size1)
+			continue;
+
+		//Write the batch with vectored I/O, the last block is zero padded.
+		size_t nblocks = (fill + sb.block_size - 1) / sb.block_size;
+		std::fill(batch.begin() + fill, batch.begin() + nblocks * sb.block_size, 0);
+		std::vector<unsigned> block_nos(targets.begin() + next, targets.begin() + next + nblocks);
+		std::vector<const uint8_t*> blks;
+		for (size_t i = 0; i < nblocks; i++)
+			blks.push_back(batch.data() + i * sb.block_size);
+		if (cache.write_blocks(block_nos, blks))
+		{
+			close(fd);
+			std::cerr << "ERROR! Could not write the file data." << std::endl;
+			return -1;
 		}
+		next += nblocks;
+		fill = 0;
 	}
+	close(fd);
 
-	for (size_t j = 0; j < empty.size(); j++)
+	//Link the new blocks to each other from the back, then after the old last block. The new last block is
+	//remembered for the next append.
+	for (size_t i = empty.size(); i-- > 0;)
 	{
-		fat[originallastblock] = empty[j];
-		originallastblock = fat[originallastblock];
+		set_fat(empty[i], i + 1 < empty.size() ? empty[i + 1] : FAT_EOF);
+		if (checkpoint())
+			return -1;
+	}
+	if (!empty.empty())
+	{
+		set_fat(tail, empty[0]);
+		tail = empty.back();
 	}
-	fat[originallastblock] = EOF;
+	tails[entry2.first_blk] = {(uint32_t)tail, share_gen};
+	write_fat();
 
-	if (updateSize(entry1.size, filepath2) == -1) //Update the sizes after the append.
+	if (add_size(chain2, size1) == -1) //Update the sizes after the append.
 	{
 		std::cerr << "Error! Could not update the sizes." << std::endl;
 		return -1;
@@ -657,6 +1036,10 @@ int FS::append(std::string filepath1, std::string filepath2)
 // in the current directory
 int FS::mkdir(std::string dirpath)
 {
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
+
 	dir_entry currentDir = find_dir_entry(dirpath);
 	if (currentDir.file_name[0] != '\0')
 	{
@@ -671,14 +1054,25 @@ int FS::mkdir(std::string dirpath)
 	std::string temppath = "";
 
 	temppath = dirpath.substr(dirpath.find_last_of('/') + 1, dirpath.length() - 1);
-	dirpath.erase(dirpath.find_last_of('/'), dirpath.length() - 1);
+	dirpath.erase(dirpath.find_last_of('/') + 1);
 
-	currentDir = find_dir_entry(dirpath);
+	std::vector<dir_entry> parents;
+	if (resolve(dirpath, parents) || parents.back().type != TYPE_DIR)
+	{
+		std::cerr << "Error! The parent directory does not exist." << std::endl;
+		return -1;
+	}
+	currentDir = parents.back();
 	//New directory
 	dir_entry newDir;
-	temppath.copy(newDir.file_name, 56);
+	temppath.copy(newDir.file_name, sizeof(newDir.file_name));
 	std::vector<int> empty_spot(1);
 	empty_spot[0] = find_empty();
+	if (empty_spot[0] == -1)
+	{
+		std::cerr << "ERROR! No empty spots in the FAT." << std::endl;
+		return -1;
+	}
 	newDir.first_blk = empty_spot[0];
 	newDir.size = 0;
 	newDir.type = 1;
@@ -693,40 +1087,23 @@ int FS::mkdir(std::string dirpath)
 	returnDir.type = 1;
 	returnDir.access_rights = READ | WRITE | EXECUTE;
 
-	//Read current block.
-	uint8_t buff[BLOCK_SIZE] = { 0 };
-	dir_entry* currentblock = (dir_entry*)(buff);
-	disk.read(currentDir.first_blk, (uint8_t*)currentblock);
+	//Claim the new block first, so a parent directory that grows cannot take it.
+	set_fat(empty_spot[0], FAT_EOF);
 
-	//Find an empty spot for the new directory.
-	unsigned int k = 1;
-	while (currentblock[k].file_name[0] != '\0' && k < BLOCK_SIZE / sizeof(dir_entry))
-		k++;
+	//Write the new directory with the return dir in its first slot.
+	dir_init(empty_spot[0], returnDir);
 
-	//If there is no empty spot.
-	if (currentblock[k].file_name[0] != '\0')
+	//Put the new directory in the current directory.
+	if (dir_insert(currentDir.first_blk, newDir))
 	{
 		std::cerr << "ERROR! No more space for dir_entries in the current block." << std::endl;
+		set_fat(empty_spot[0], FAT_FREE);
+		write_fat();
 		return -1;
 	}
-	//Put the new directory in the empty spot.
-	else
-		currentblock[k] = newDir;
-
-	//Write back the current block.
-	disk.write(currentDir.first_blk, (uint8_t*)currentblock);
-
-	//Read new block, that is for the new directory entry.
-	uint8_t buff2[BLOCK_SIZE] = { 0 };
-	dir_entry* newblock = (dir_entry*)buff2;
-	newblock[0] = returnDir;
-
-	//Write the return dir.
-	disk.write(empty_spot[0], (uint8_t*)newblock);
 
 	//Update fat.
-	fat[empty_spot[0]] = FAT_EOF;
-	disk.write(FAT_BLOCK, (uint8_t*)fat);
+	write_fat();
 
 	return 0;
 }
@@ -768,6 +1145,8 @@ int FS::cd(std::string dirpath)
 // directory, including the currect directory name
 int FS::pwd()
 {
+	if (check_loaded())
+		return -1;
 	std::cout << path << std::endl;
 	return 0;
 }
@@ -776,12 +1155,14 @@ int FS::pwd()
 // file <filepath> to <accessrights>.
 int FS::chmod(std::string accessrights, std::string filepath)
 {
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
+
 	dir_entry valid = find_dir_entry(filepath);
 	if (*valid.file_name == '\0')
 		return 1;
 
-	uint8_t block[BLOCK_SIZE];
-
 	if (filepath[0] != '/')
 		filepath = path + filepath;
 
@@ -792,11 +1173,8 @@ int FS::chmod(std::string accessrights, std::string filepath)
 	//Retrive the dir etntry of the dir/file to be changed.
 	dir_entry dirtoload = find_dir_entry(filepath);
 
-	disk.read(dirtoload.first_blk, block);
-
-	//Look for valid in block.
-	dir_entry* it;
-	for (it = (dir_entry*)block; std::strcmp(it->file_name, valid.file_name); it++);
+	//Change a copy of valid and put it back in its directory afterwards.
+	dir_entry* it = &valid;
 
 	size_t accsessnum = std::stoul(accessrights);
 	switch (accsessnum)
@@ -830,213 +1208,2008 @@ int FS::chmod(std::string accessrights, std::string filepath)
 		break;
 	}
 
-	disk.write(dirtoload.first_blk, block);
+	//The root's own entry is slot 0 of the root directory.
+	if (valid.type == TYPE_DIR && valid.first_blk == sb.root_block)
+		dir_set_self(sb.root_block, valid);
+	else
+		dir_update(dirtoload.first_blk, valid);
 
 	return 0;
 }
 
-//Helper functions
-//----------------------------------------------------------------------------
-
-//Helper function to find an empty spot for the new file. Called in create
-int FS::find_empty()
+//Reads the superblock and the FAT, the disk takes the geometry of the file system.
+int FS::mount(bool lazy)
 {
-	//After the root and FAT entry.
-	int i = 2;
-	//Go through the FAT until a free spot is found or the end of the array is reached.
-	while (fat[i] != FAT_FREE and i < BLOCK_SIZE / 2)
-		i++;
+	//Until a superblock is found, act as if the disk had one FAT block followed by the root directory.
+	sb.magic = 0;
+	sb.version = FS_VERSION;
+	sb.block_size = disk.get_block_size();
+	sb.no_blocks = std::min(disk.get_no_blocks(), fat_entries());
+	sb.fat_block = SUPER_BLOCK + 1;
+	sb.fat_blocks = 1;
+	sb.journal_block = sb.fat_block + sb.fat_blocks;
+	sb.journal_blocks = 0;
+	sb.ref_block = sb.journal_block;
+	sb.ref_blocks = 0;
+	sb.root_block = sb.journal_block;
+	fat.assign(fat_entries(), FAT_FREE);
+	fat_loaded.assign(sb.fat_blocks, true);
+	fat_dirty.assign(sb.fat_blocks, false);
+	refs.clear();
+	ref_dirty.clear();
+	meta_dirty = 0;
+	for (unsigned i = 0; i <= sb.root_block; i++)
+		fat[i] = FAT_EOF;
+	build_free_map();
+
+	std::vector<uint8_t> block(disk.get_block_size());
+	if (disk.get_no_blocks() == 0 || disk.read(SUPER_BLOCK, block.data()))
+		return -1;
+	superblock found;
+	memcpy(&found, block.data(), sizeof(found));
+	if (found.magic != FS_MAGIC || found.version < 2 || found.version > FS_VERSION)
+		return -1;
+	//Version 2 has no journal, the root directory follows the FAT. Before version 4 no blocks are shared.
+	if (found.version == 2)
+	{
+		found.journal_block = found.fat_block + found.fat_blocks;
+		found.journal_blocks = 0;
+	}
+	if (found.version < 4)
+	{
+		found.ref_block = found.journal_block + found.journal_blocks;
+		found.ref_blocks = 0;
+	}
+	if (found.block_size < MIN_BLOCK_SIZE || found.block_size > MAX_BLOCK_SIZE || found.no_blocks < MIN_NO_BLOCKS
+		|| found.no_blocks > MAX_NO_BLOCKS || found.fat_block != SUPER_BLOCK + 1
+		|| (uint64_t)found.fat_blocks * (found.block_size / sizeof(int32_t)) < found.no_blocks
+		|| found.journal_block != found.fat_block + found.fat_blocks
+		|| (found.journal_blocks != 0 && found.journal_blocks < JOURNAL_MIN_BLOCKS)
+		|| found.ref_block != found.journal_block + found.journal_blocks
+		|| (found.ref_blocks != 0 && (uint64_t)found.ref_blocks * (found.block_size / sizeof(uint16_t)) < found.no_blocks)
+		|| found.root_block != found.ref_block + found.ref_blocks || found.root_block >= found.no_blocks)
+	{
+		std::cerr << "Error! The superblock is corrupt." << std::endl;
+		return -1;
+	}
 
-	//If it found a free spot.
-	if (fat[i] == FAT_FREE)
-		return i;
+	//Switch the disk to the geometry of the file system.
+	cache.invalidate();
+	dcache.clear();
+	tails.clear();
+	size_deltas.clear();
+	journal_reset();
+	open_files.clear();
+	defrag = defrag_cursor();
+	if ((found.block_size != disk.get_block_size() || found.no_blocks != disk.get_no_blocks())
+		&& disk.set_geometry(found.block_size, found.no_blocks))
+		return -1;
+	sb = found;
 
-	//If no free spot was found.
-	else
+	//A commit that did not finish writing its blocks home is finished before anything is read.
+	if (journal_replay())
 		return -1;
+
+	//Directories are read when they are first used, a lazy mount reads the rest in the background as well. The loader
+	//takes the lock for one batch at a time, so commands run in between.
+	fat.assign((size_t)sb.fat_blocks * fat_entries(), FAT_FREE);
+	fat_loaded.assign(sb.fat_blocks, false);
+	fat_dirty.assign(sb.fat_blocks, false);
+	refs.assign((size_t)sb.ref_blocks * ref_entries(), 0);
+	ref_dirty.assign(sb.ref_blocks, false);
+	meta_dirty = 0;
+	loading = true;
+	load_next = 0;
+	if (lazy)
+	{
+		loader = std::thread([this]()
+		{
+			int ret = 1;
+			while (ret == 1)
+			{
+				{
+					std::lock_guard<std::recursive_mutex> guard(mutex);
+					ret = stopping ? 0 : load_step();
+				}
+				std::this_thread::yield();
+			}
+		});
+		return 0;
+	}
+	return load_all();
 }
 
-//Helper function to find multiple empty spots for the new file. Called in create
-std::vector<int> FS::find_multiple_empty(int numBlocks)
+//Reads the next IO_BATCH_BLOCKS FAT blocks that no lookup has read yet, then the reference counts, with vectored I/O,
+//and builds the free map once everything is read. Returns 1 while there is more to read, 0 when the file system is
+//loaded, or -1 if it could not be read.
+int FS::load_step()
 {
-	std::vector<int> empty_spots(numBlocks);
-	//After the root and fat entries.
-	int j = 2;
-	for (int i = 0; i < numBlocks; i++)
+	if (load_failed)
+		return -1;
+	if (!loading)
+		return 0;
+	std::vector<unsigned> block_nos;
+	std::vector<uint8_t*> blks;
+	for (; load_next < sb.fat_blocks + sb.ref_blocks && block_nos.size() < IO_BATCH_BLOCKS; load_next++)
 	{
-		//Step through the fat until a free spot is found or the end of the fat is reached.
-		while (fat[j] != FAT_FREE && j < BLOCK_SIZE / 2)
-			j++;
-
-		if (fat[j] == FAT_FREE) //If it found a free spot.
+		if (load_next < sb.fat_blocks)
+		{
+			if (fat_loaded[load_next])
+				continue;
+			block_nos.push_back(sb.fat_block + load_next);
+			blks.push_back((uint8_t*)(fat.data() + (size_t)load_next * fat_entries()));
+		}
+		else
 		{
-			empty_spots[i] = j;
-			j++;
+			block_nos.push_back(sb.ref_block + load_next - sb.fat_blocks);
+			blks.push_back((uint8_t*)(refs.data() + (size_t)(load_next - sb.fat_blocks) * ref_entries()));
 		}
-		else //If it did not, then there are none.
-			empty_spots[0] = -1;
 	}
-
-	return empty_spots;
+	if (block_nos.empty())
+	{
+		build_free_map();
+		loading = false;
+		return 0;
+	}
+	if (cache.read_blocks(block_nos, blks))
+	{
+		load_failed = true;
+		return -1;
+	}
+	for (unsigned block_no : block_nos)
+		if (block_no < sb.fat_block + sb.fat_blocks)
+			fat_loaded[block_no - sb.fat_block] = true;
+	return 1;
 }
 
-//Returns the dir_entry of filepath
-dir_entry FS::find_dir_entry(std::string filepath)
+//Reads whatever a lazy mount has not read yet, for an operation that needs the whole FAT and the free map. The caller
+//holds the lock, so the loader finds nothing left to do.
+int FS::load_all()
 {
-	///TODO: Rerwrite this whole finction since we do not have a folder named root anymore. And there is a simpler way of doing this.
-	//Read root block.
-	uint8_t block[BLOCK_SIZE] = { 0 };
-	disk.read(ROOT_BLOCK, block);
-	dir_entry* dirblock = (dir_entry*)(block);
-
-	std::string fullpath("");
-
-	// if (filepath.back() != '/')
-	// 	filepath.append("/");
-
-	// if (filepath.find("/") != 0u)
-	// 	filepath = path + filepath;
-
-	//filepath = "root" + filepath;
+	while (load_step() == 1)
+		;
+	return check_loaded();
+}
 
-	size_t start_i = 0, end_i = 0, i = 0;
+//Returns -1 if the file system could not be loaded, nothing on the disk can be trusted then.
+int FS::check_loaded()
+{
+	if (!load_failed)
+		return 0;
+	std::cerr << "Error! The file system could not be loaded, use format to create a new one." << std::endl;
+	return -1;
+}
 
-	while ((end_i = filepath.find('/', end_i)) not_eq std::string::npos)
+//Returns the FAT entry of block_no, the FAT block holding it is read first if a lazy mount has not got to it yet.
+//FAT_FREE is returned if it could not be read.
+int32_t FS::fat_at(unsigned block_no)
+{
+	if (loading && !fat_loaded[block_no / fat_entries()])
 	{
-		i = 0;
-		std::string dirname = filepath.substr(start_i, end_i - start_i);
-		while (dirname.compare(dirblock->file_name)) //Check if dir_entry name exists in this folder.
+		unsigned i = block_no / fat_entries();
+		if (load_failed || cache.read(sb.fat_block + i, (uint8_t*)(fat.data() + (size_t)i * fat_entries())))
 		{
-			dirblock++;
-			i++;
-			if (i == std::floor(BLOCK_SIZE / sizeof(dir_entry)))
-				return dir_entry();
+			load_failed = true;
+			return FAT_FREE;
 		}
+		fat_loaded[i] = true;
+	}
+	return fat[block_no];
+}
 
-		start_i = ++end_i;
-
-		//This folder exists, load in that folders disk block.
-		if ((end_i = filepath.find('/', end_i)) not_eq std::string::npos)
+//Changes one FAT entry and marks the FAT block that holds it as dirty.
+void FS::set_fat(unsigned block_no, int32_t next)
+{
+	fat[block_no] = next;
+	if (!fat_dirty[block_no / fat_entries()])
+	{
+		fat_dirty[block_no / fat_entries()] = true;
+		meta_dirty++;
+	}
+	if (next == FAT_FREE)
+	{
+		//With a journal the block is reused after the commit, and its changes do not need to be committed.
+		if (sb.journal_blocks == 0)
+			free_map.release(block_no);
+		else
 		{
-			disk.read(dirblock->first_blk, block);
-			dirblock = (dir_entry*)block;
+			txn_freed.push_back(block_no);
+			if (txn_blocks.erase(block_no))
+			{
+				cache.unpin(block_no);
+				cache.discard(std::vector<unsigned>(1, block_no));
+			}
 		}
+		//A freed directory block may be reused for file data, and a freed first block for another file.
+		dcache.erase(block_no);
+		tails.erase(block_no);
+		if (!refs.empty() && refs[block_no] != 0)
+			set_ref(block_no, 0);
 	}
-	return ((dir_entry*)block)[i];
+	else
+		free_map.reserve(block_no);
 }
 
-int FS::updateSize(uint32_t size, std::string updateFrom)
+void FS::set_ref(unsigned block_no, uint16_t extra)
 {
-	std::string currentDir = "";
+	if (extra > refs[block_no])
+		share_gen++;
+	refs[block_no] = extra;
+	if (!ref_dirty[block_no / ref_entries()])
+	{
+		ref_dirty[block_no / ref_entries()] = true;
+		meta_dirty++;
+	}
+}
 
-	//If the last part of the path is a file. Remove it from the string so that the path only contains directories.
-	if (find_dir_entry(updateFrom).type == 0)
+//Drops a reference to the chain starting at first_blk. Its blocks are freed up to the first one that is still
+//reached some other way. The entry or block that led to the chain is gone already, so the group may be committed
+//between the blocks.
+void FS::release_chain(int first_blk)
+{
+	for (int block_no = first_blk; block_no != FAT_EOF;)
 	{
+		if (!refs.empty() && refs[block_no] != 0)
+		{
+			set_ref(block_no, refs[block_no] - 1);
+			return;
+		}
+		int next = fat[block_no];
+		set_fat(block_no, FAT_FREE);
+		checkpoint();
+		block_no = next;
+	}
+}
 
-		dir_entry file = find_dir_entry(updateFrom);
-		file.size += size;
+//True if any block of the chain starting at first_blk is shared with another file.
+bool FS::shares_blocks(int first_blk)
+{
+	if (refs.empty())
+		return false;
+	for (int block_no = first_blk; block_no != FAT_EOF; block_no = fat[block_no])
+		if (refs[block_no] != 0)
+			return true;
+	return false;
+}
 
-		while (updateFrom.back() != '/' && updateFrom != "")
-			updateFrom.pop_back();
+//Makes blocks 0 to k of a file its own, before they are changed. When a block on the way is shared, the blocks from
+//there to k are copied and the copy of block k links on to the rest of the shared chain. Returns 1 if blocks were
+//copied, 0 if the file owned them already, or -1.
+int FS::unshare(unsigned dir_blk, dir_entry& entry, uint64_t k)
+{
+	if (refs.empty())
+		return 0;
 
-		if (updateFrom.back() == '/' && updateFrom.size() > 1)
-			updateFrom.pop_back();
+	//Find the first shared block on the way to block k.
+	int prev = -1;
+	int block_no = entry.first_blk;
+	uint64_t i = 0;
+	while (refs[block_no] == 0)
+	{
+		if (i == k || fat[block_no] == FAT_EOF)
+			return 0;
+		prev = block_no;
+		block_no = fat[block_no];
+		i++;
+	}
+	std::vector<unsigned> old_nos;
+	for (; ; i++, block_no = fat[block_no])
+	{
+		old_nos.push_back(block_no);
+		if (i == k || fat[block_no] == FAT_EOF)
+			break;
+	}
+	int32_t tail = fat[old_nos.back()];
+	if (tail != FAT_EOF && refs[tail] == REF_MAX)
+	{
+		std::cerr << "Error! The file shares its blocks too many times." << std::endl;
+		return -1;
+	}
+	std::vector<int> new_nos = find_multiple_empty(old_nos.size());
+	if (new_nos[0] == -1)
+	{
+		std::cerr << "ERROR! Not enough empty spots in the FAT." << std::endl;
+		return -1;
+	}
+	//The last block of the copy is a different one.
+	tails.erase(entry.first_blk);
 
-		dir_entry homeFolder = find_dir_entry(updateFrom);
-		uint8_t block[BLOCK_SIZE] = { 0 };
-		disk.read(homeFolder.first_blk, block);
-		dir_entry* entry = (dir_entry*)block;
-		int i = 0;
-		while (std::strcmp(file.file_name, entry->file_name) && i < std::floor(BLOCK_SIZE / sizeof(dir_entry)))
+	//Copy the blocks in batches with vectored I/O.
+	std::vector<uint8_t> buffer(std::min(old_nos.size(), (size_t)IO_BATCH_BLOCKS) * sb.block_size);
+	for (size_t j = 0; j < old_nos.size(); j += IO_BATCH_BLOCKS)
+	{
+		size_t n = std::min(old_nos.size() - j, (size_t)IO_BATCH_BLOCKS);
+		std::vector<unsigned> source_nos(old_nos.begin() + j, old_nos.begin() + j + n);
+		std::vector<unsigned> dest_nos(new_nos.begin() + j, new_nos.begin() + j + n);
+		std::vector<uint8_t*> blks;
+		for (size_t b = 0; b < n; b++)
+			blks.push_back(buffer.data() + b * sb.block_size);
+		if (cache.read_blocks(source_nos, blks) || cache.write_blocks(dest_nos, std::vector<const uint8_t*>(blks.begin(), blks.end())))
 		{
-			i++;
-			entry++;
+			std::cerr << "Error! Could not copy the shared blocks." << std::endl;
+			return -1;
 		}
-		*entry = file;
+	}
 
-		disk.write(homeFolder.first_blk, block);
+	//Link the copies to each other and on to the rest of the shared chain, from the back, so nothing reaches them
+	//before they are linked.
+	for (size_t j = new_nos.size(); j-- > 0;)
+	{
+		set_fat(new_nos[j], j + 1 < new_nos.size() ? new_nos[j + 1] : tail);
+		if (checkpoint())
+			return -1;
 	}
 
-	//if it is a relative path, make it an absolute path.
-	if (updateFrom[0] != '/')
-		updateFrom = path + updateFrom;
+	//Then link them in place of the shared blocks. The first shared block loses this file's reference and the rest
+	//of the chain after block k gains one.
+	if (tail != FAT_EOF)
+		set_ref(tail, refs[tail] + 1);
+	set_ref(old_nos[0], refs[old_nos[0]] - 1);
+	if (prev == -1)
+	{
+		entry.first_blk = new_nos[0];
+		dir_update(dir_blk, entry);
+	}
+	else
+		set_fat(prev, new_nos[0]);
+	cow_gen++;
+	if (write_fat())
+		return -1;
+	return 1;
+}
 
-	dir_entry currentEntry;
-	uint8_t block[BLOCK_SIZE] = { 0 };
+//Builds the free block map from the FAT, one pass over it.
+void FS::build_free_map()
+{
+	free_map.reset(sb.no_blocks);
+	for (unsigned i = 0; i < sb.no_blocks; i++)
+		if (fat[i] == FAT_FREE)
+			free_map.release(i);
+}
 
-	while (updateFrom.find('/') != std::string::npos && updateFrom != "/")
+//Writes the FAT blocks that changed since the last call.
+int FS::write_fat()
+{
+	for (unsigned i = 0; i < sb.fat_blocks; i++)
 	{
-		currentDir = "";
+		if (!fat_dirty[i])
+			continue;
+		if (meta_write(sb.fat_block + i, (uint8_t*)(fat.data() + (size_t)i * fat_entries())))
+			return -1;
+		fat_dirty[i] = false;
+		meta_dirty--;
+	}
+	for (unsigned i = 0; i < sb.ref_blocks; i++)
+	{
+		if (!ref_dirty[i])
+			continue;
+		if (meta_write(sb.ref_block + i, (uint8_t*)(refs.data() + (size_t)i * ref_entries())))
+			return -1;
+		ref_dirty[i] = false;
+		meta_dirty--;
+	}
+	return 0;
+}
 
-		//Extract the folder at the end of the path.
-		size_t lastslash = updateFrom.find_last_of("/");
-		if (updateFrom.size() > 1)
-			currentDir = updateFrom.substr(lastslash + 1, updateFrom.size() - 1);
-		else
-			currentDir = "/";
+//The number of blocks one transaction can hold, limited by the journal and by the block numbers that fit in the descriptor.
+unsigned FS::journal_capacity()
+{
+	if (sb.journal_blocks < JOURNAL_MIN_BLOCKS)
+		return 0;
+	return std::min(sb.journal_blocks - 2, (unsigned)((sb.block_size - sizeof(journal_header)) / sizeof(uint32_t)));
+}
 
-		//Do this for all folders except root, which is handled later.
-		if (currentDir != "/" && currentDir != "..")
-		{
-			//Get the dir for the current folder and increase the size.
-			currentEntry = find_dir_entry(updateFrom);
-			currentEntry.size += size;
-
-			//Read this folder's block
-			dir_entry* dirblock = (dir_entry*)block;
-			disk.read(currentEntry.first_blk, (uint8_t*)dirblock);
-
-			//Save the index of the block where the directory lies.
-			int block_number = dirblock->first_blk;
-			//Then read the block where the directory was.
-			disk.read(dirblock->first_blk, (uint8_t*)dirblock);
-
-			//Find the spot where the dir is.
-			int j = 0;
-			while (std::strcmp(currentEntry.file_name, dirblock->file_name) && j < std::floor(BLOCK_SIZE / sizeof(dir_entry)))
-			{
-				j++;
-				dirblock++;
-			}
-			//Replace it with the entry that has an updated size.
-			*dirblock = currentEntry;
+//Writes a metadata block. With a journal it stays pinned in the cache until the next commit.
+int FS::meta_write(unsigned block_no, const uint8_t* blk)
+{
+	if (sb.journal_blocks == 0)
+		return cache.write(block_no, blk);
+	if (txn_blocks.count(block_no) == 0)
+	{
+		txn_blocks.insert(block_no);
+		if (cache.write(block_no, blk))
+			return -1;
+		return cache.pin(block_no) == nullptr ? -1 : 0;
+	}
+	return cache.write(block_no, blk);
+}
 
-			//Write back the block.
-			disk.write(block_number, block);
-		}
+//Starts an operation, after the rest of a lazy mount is read. The group is committed first when the journal could not
+//hold the operation's first step.
+int FS::begin_op()
+{
+	int ret = load_all();
+	if (txn_depth++ == 0 && !ret)
+		checkpoint();
+	return ret;
+}
+
+//Ends an operation, the group is committed when it is large or old enough.
+void FS::end_op()
+{
+	if (--txn_depth > 0)
+		return;
+	if (txn_ops++ == 0)
+	{
+		txn_start = std::chrono::steady_clock::now();
+		group_cv.notify_one();
+	}
+	if (txn_ops >= JOURNAL_GROUP_OPS || std::chrono::steady_clock::now() - txn_start >= std::chrono::milliseconds(JOURNAL_GROUP_MS))
+	{
+		flush_sizes();
+		journal_commit();
+	}
+}
 
-		if (updateFrom.back() == '/')
-			updateFrom.pop_back();
+//Commits the group when the journal could not hold another step of the running operation, counting the FAT blocks
+//and directory sizes that are not written yet. A small journal keeps half of itself for the step. Operations only
+//call it where the metadata they changed so far is consistent, at worst with blocks allocated that no file reaches
+//yet, which fsck frees.
+int FS::checkpoint()
+{
+	unsigned reserve = std::min((unsigned)JOURNAL_OP_BLOCKS, journal_capacity() / 2);
+	if (sb.journal_blocks == 0 || txn_blocks.size() + meta_dirty + size_deltas.size() + reserve <= journal_capacity())
+		return 0;
+	if (flush_sizes() || write_fat())
+		return -1;
+	return journal_commit();
+}
 
-		if (currentDir == "..")
+//Runs in the background and commits a group JOURNAL_GROUP_MS after its first operation ended, so the last
+//operations before an idle period do not wait for the next one.
+void FS::commit_timer()
+{
+	std::unique_lock<std::recursive_mutex> guard(mutex);
+	while (!stopping)
+	{
+		if (txn_ops == 0)
 		{
-			updateFrom.erase(updateFrom.find(currentDir), currentDir.length());
-			updateFrom.pop_back();
-			while (updateFrom.back() != '/')
-				updateFrom.pop_back();
+			group_cv.wait(guard);
+			continue;
 		}
-		else
-			updateFrom.erase(updateFrom.find(currentDir), currentDir.length()); //Erase the found folder from the end of the path.
+		auto due = txn_start + std::chrono::milliseconds(JOURNAL_GROUP_MS);
+		if (std::chrono::steady_clock::now() < due)
+		{
+			group_cv.wait_until(guard, due);
+			continue;
+		}
+		flush_sizes();
+		journal_commit();
+	}
+}
 
-		//Remove the slash at the end of the path.
-		updateFrom.pop_back();
+//Writes one transaction through the journal. The descriptor, the copies of the blocks and the file data are
+//flushed before the commit block is written, so a commit block on the disk means the transaction is complete.
+//Only then are the blocks written home.
+int FS::journal_write(const std::vector<unsigned>& block_nos)
+{
+	unsigned count = block_nos.size();
+
+	//The descriptor and the copies are contiguous, they are written with vectored I/O.
+	std::vector<uint8_t> buffer((size_t)(count + 2) * sb.block_size, 0);
+	journal_header* desc = (journal_header*)buffer.data();
+	desc->magic = JOURNAL_MAGIC;
+	desc->seq = ++journal_seq;
+	desc->count = count;
+	std::copy(block_nos.begin(), block_nos.end(), (uint32_t*)(desc + 1));
+	std::vector<unsigned> journal_nos;
+	std::vector<const uint8_t*> blks;
+	for (unsigned i = 0; i <= count; i++)
+	{
+		uint8_t* blk = buffer.data() + (size_t)i * sb.block_size;
+		if (i > 0 && cache.read(block_nos[i - 1], blk))
+			return -1;
+		journal_nos.push_back(sb.journal_block + i);
+		blks.push_back(blk);
 	}
+	//The file data the metadata points at is written back with them, in the same flush.
+	if (disk.write_blocks(journal_nos, blks) || cache.sync(true))
+		return -1;
 
-	updateFrom = "/";
+	//The commit block makes the transaction count.
+	uint8_t* commit = buffer.data() + (size_t)(count + 1) * sb.block_size;
+	journal_header* rec = (journal_header*)commit;
+	rec->magic = JOURNAL_COMMIT_MAGIC;
+	rec->seq = desc->seq;
+	rec->count = count;
+	rec->checksum = fnv1a(buffer.data(), (size_t)(count + 1) * sb.block_size);
+	if (disk.write(sb.journal_block + count + 1, commit) || disk.sync())
+		return -1;
 
-	//For the root map.
-	//---------------------------------------------
-	//Get the root dir and update its size.
-	currentEntry = find_dir_entry(updateFrom);
-	currentEntry.size += size;
+	//Now the blocks go home, and may leave the cache again.
+	if (cache.writeback(block_nos) || disk.sync())
+		return -1;
+	for (auto block_no : block_nos)
+	{
+		cache.unpin(block_no);
+		txn_blocks.erase(block_no);
+	}
 
-	//Read the root block.
-	dir_entry* dirblock = (dir_entry*)block;
-	disk.read(ROOT_BLOCK, block);
+	//The journal is empty again, the sequence number is kept for the next mount.
+	std::vector<uint8_t> empty(sb.block_size, 0);
+	((journal_header*)empty.data())->seq = journal_seq;
+	return disk.write(sb.journal_block, empty.data());
+}
 
-	//Put back the updated root directory.
-	dirblock[0] = currentEntry;
+//Commits the metadata changed since the last commit as one transaction, the whole group shares its flushes.
+int FS::journal_commit()
+{
+	if (txn_blocks.empty() || sb.journal_blocks == 0)
+	{
+		txn_ops = 0;
+		return cache.sync();
+	}
+	//Operations commit between steps that fit the journal, a transaction only outgrows it when a single step
+	//changes more blocks than a very small journal holds. It is written in parts then.
+	std::vector<unsigned> block_nos(txn_blocks.begin(), txn_blocks.end());
+	for (size_t i = 0; i < block_nos.size(); i += journal_capacity())
+	{
+		std::vector<unsigned> part(block_nos.begin() + i, block_nos.begin() + std::min(block_nos.size(), i + journal_capacity()));
+		if (journal_write(part))
+			return -1;
+	}
 
-	disk.write(ROOT_BLOCK, block);
+	//Blocks freed by the transaction can be reused from now on.
+	for (auto block_no : txn_freed)
+		if (fat[block_no] == FAT_FREE)
+			free_map.release(block_no);
+	txn_freed.clear();
+	journal_commits++;
+	journal_group_ops += txn_ops;
+	txn_ops = 0;
 	return 0;
+}
+
+//Writes the blocks of a committed transaction home again, in case the commit was interrupted before they all got there.
+//A transaction without a valid commit block never happened.
+int FS::journal_replay()
+{
+	if (journal_capacity() == 0)
+		return 0;
+	std::vector<uint8_t> block(sb.block_size, 0);
+	if (disk.read(sb.journal_block, block.data()))
+		return -1;
+	journal_header desc = *(journal_header*)block.data();
+	journal_seq = desc.seq;
+	if (desc.magic != JOURNAL_MAGIC || desc.count == 0 || desc.count > journal_capacity())
+		return 0;
+
+	//Read the descriptor, the copies and the commit block at once.
+	unsigned count = desc.count;
+	std::vector<uint8_t> buffer((size_t)(count + 2) * sb.block_size, 0);
+	std::vector<unsigned> journal_nos;
+	std::vector<uint8_t*> blks;
+	for (unsigned i = 0; i < count + 2; i++)
+	{
+		journal_nos.push_back(sb.journal_block + i);
+		blks.push_back(buffer.data() + (size_t)i * sb.block_size);
+	}
+	if (disk.read_blocks(journal_nos, blks))
+		return -1;
+	journal_header* rec = (journal_header*)blks[count + 1];
+	if (rec->magic != JOURNAL_COMMIT_MAGIC || rec->seq != desc.seq || rec->count != count
+		|| rec->checksum != fnv1a(buffer.data(), (size_t)(count + 1) * sb.block_size))
+		return 0;
+
+	uint32_t* homes = (uint32_t*)((journal_header*)blks[0] + 1);
+	std::vector<unsigned> block_nos;
+	std::vector<const uint8_t*> copies;
+	for (unsigned i = 0; i < count; i++)
+	{
+		//A home in the journal itself or past the disk means the journal is corrupt.
+		if (homes[i] >= sb.no_blocks || (homes[i] >= sb.journal_block && homes[i] < sb.journal_block + sb.journal_blocks))
+		{
+			std::cerr << "Error! The journal is corrupt." << std::endl;
+			return -1;
+		}
+		block_nos.push_back(homes[i]);
+		copies.push_back(blks[i + 1]);
+	}
+	if (disk.write_blocks(block_nos, copies) || disk.sync())
+		return -1;
+	std::fill(block.begin(), block.end(), 0);
+	((journal_header*)block.data())->seq = journal_seq;
+	if (disk.write(sb.journal_block, block.data()) || disk.sync())
+		return -1;
+	std::cout << "Replayed " << count << " blocks from the journal.\n";
+	return 0;
+}
+
+//Forgets the running transaction, after the cache was dropped.
+void FS::journal_reset()
+{
+	txn_blocks.clear();
+	txn_freed.clear();
+	txn_ops = 0;
+}
+
+// returns the asynchronous disk used for bulk transfers, it is set up on first use
+AsyncDisk& FS::async_disk()
+{
+	if (!aio)
+		aio.reset(new AsyncDisk(disk));
+	return *aio;
+}
+
+// stats prints the block cache and journal counters, the free space and how fragmented the files are
+int FS::stats()
+{
+	if (load_all())
+		return -1;
+	uint64_t lookups = cache.get_hits() + cache.get_misses();
+	std::cout << "cache blocks:\t" << cache.get_size() << "/" << cache.get_capacity() << std::endl;
+	std::cout << "hits:\t\t" << cache.get_hits() << std::endl;
+	std::cout << "misses:\t\t" << cache.get_misses() << std::endl;
+	std::cout << "evictions:\t" << cache.get_evictions() << std::endl;
+	std::cout << "writebacks:\t" << cache.get_writebacks() << std::endl;
+	if (lookups > 0)
+		std::cout << "hit rate:\t" << (100.0 * cache.get_hits() / lookups) << "%" << std::endl;
+	std::cout << "dentry hits:\t" << dcache_hits << std::endl;
+	std::cout << "dentry misses:\t" << dcache_misses << std::endl;
+	std::cout << "commits:\t" << journal_commits << std::endl;
+	if (journal_commits > 0)
+		std::cout << "ops/commit:\t" << (double)journal_group_ops / journal_commits << std::endl;
+	std::cout << "free blocks:\t" << free_map.get_free() << "/" << sb.no_blocks << std::endl;
+
+	//Free space fragmentation, the number of runs the free blocks form.
+	unsigned free_extents = 0;
+	for (int pos = free_map.find_next(0); pos != -1; free_extents++)
+		pos = free_map.find_next(pos + free_map.run_length(pos, sb.no_blocks));
+	std::cout << "free extents:\t" << free_extents << std::endl;
+
+	//Blocks that more than one file reaches, from the start of the chain that is shared.
+	if (!refs.empty())
+		std::cout << "shared blocks:\t" << std::count_if(refs.begin(), refs.end(), [](uint16_t extra) { return extra != 0; }) << std::endl;
+
+	//File fragmentation, 1 extent per file means every file is contiguous.
+	unsigned files = 0, extents = 0;
+	count_extents(sb.root_block, files, extents);
+	std::cout << "files:\t\t" << files << std::endl;
+	if (files > 0)
+		std::cout << "extents/file:\t" << (double)extents / files << std::endl;
+	return 0;
+}
+
+// sync commits the journal and writes all dirty cached blocks back to the disk
+int FS::sync()
+{
+	if (check_loaded())
+		return -1;
+	if (flush_sizes())
+		return -1;
+	return journal_commit();
+}
+
+// defrag [<ms>] moves fragmented files into contiguous runs of free blocks,
+// with a time limit it stops after that many milliseconds and a later
+// call continues where it left off
+int FS::defragment(unsigned time_ms)
+{
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(time_ms);
+	auto expired = [&]() { return time_ms > 0 && std::chrono::steady_clock::now() >= deadline; };
+
+	//A new pass starts at the root, an interrupted one where it stopped. Directories are kept by path, so one that
+	//was removed or moved since is skipped.
+	if (!defrag.active)
+	{
+		defrag = defrag_cursor();
+		defrag.active = true;
+		defrag.dirs.push_back("/");
+	}
+	defrag.checked = false;
+
+	//Every step is a directory read, a file checked or a batch of blocks moved, the time is checked after each.
+	unsigned moved = 0, skipped = 0;
+	do
+	{
+		std::vector<dir_entry> chain;
+		if (!defrag.file.empty())
+		{
+			int ret = resolve(defrag.dir, chain) || chain.back().type != TYPE_DIR ? 1 : relocate(chain.back().first_blk, defrag.file);
+			if (ret == -1)
+				return -1;
+			if (ret == 0)
+				continue;
+			if (ret == 1)
+				skipped++;
+			else
+				moved++;
+			defrag.file.clear();
+			defrag.moved = 0;
+			continue;
+		}
+		if (!defrag.names.empty())
+		{
+			std::string name = defrag.names.back();
+			defrag.names.pop_back();
+			if (resolve(defrag.dir + name, chain))
+				continue;
+			const dir_entry& entry = chain.back();
+			if (entry.type == TYPE_DIR)
+			{
+				defrag.dirs.push_back(defrag.dir + name + "/");
+				continue;
+			}
+			//A file is moved when a block does not follow the one before it.
+			for (int j = entry.first_blk; fat[j] != FAT_EOF; j = fat[j])
+			{
+				if (fat[j] != j + 1)
+				{
+					defrag.file = name;
+					defrag.moved = 0;
+					defrag.checked = false;
+					break;
+				}
+			}
+			continue;
+		}
+		if (defrag.dirs.empty())
+		{
+			defrag.active = false;
+			break;
+		}
+		defrag.dir = defrag.dirs.back();
+		defrag.dirs.pop_back();
+		std::vector<dir_entry> entries;
+		if (resolve(defrag.dir, chain) || chain.back().type != TYPE_DIR || dir_list(chain.back().first_blk, entries))
+			continue;
+		for (auto& entry : entries)
+			defrag.names.push_back(entry_name(entry));
+	} while (!expired());
+
+	std::cout << "defrag: moved " << moved << " files";
+	if (skipped > 0)
+		std::cout << ", " << skipped << " did not fit in any free run";
+	if (defrag.active)
+		std::cout << ", out of time, the next defrag continues";
+	std::cout << std::endl;
+	return 0;
+}
+
+// alloc <first|next|best> selects how blocks are found for new file data
+int FS::alloc(std::string policy)
+{
+	if (policy == "first")
+		alloc_policy = ALLOC_FIRST_FIT;
+	else if (policy == "next")
+		alloc_policy = ALLOC_NEXT_FIT;
+	else if (policy == "best")
+		alloc_policy = ALLOC_BEST_FIT;
+	else
+	{
+		std::cerr << "Error! Unknown allocation policy, use first, next or best." << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+// fsck [repair] checks that every block in use belongs to exactly one file or
+// directory, that file sizes match their FAT chains and that directory sizes
+// match their contents, with repair the problems found are fixed
+int FS::fsck(bool repair)
+{
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
+	flush_sizes();
+	dir_cache* root = load_dir(sb.root_block);
+	if (root == nullptr)
+	{
+		std::cerr << "Error! The root directory cannot be read." << std::endl;
+		return -1;
+	}
+
+	//Who owns each block, 0 if nobody. The superblock, FAT and journal belong to the file system.
+	std::unique_ptr<std::atomic<uint32_t>[]> owner(new std::atomic<uint32_t>[sb.no_blocks]());
+	for (unsigned i = 0; i < sb.root_block; i++)
+		owner[i] = FSCK_RESERVED;
+	owner[sb.root_block] = FSCK_FIRST_ID;
+	//How many times each block is reached, from a directory entry or another block.
+	std::unique_ptr<std::atomic<uint32_t>[]> arrivals(new std::atomic<uint32_t>[sb.no_blocks]());
+
+	struct fsck_dir
+	{
+		uint32_t blk;
+		int parent; // index in dirs, -1 for the root
+		unsigned top; // index of the directory below the root this one is in, 0 for the root
+		std::string path;
+		dir_entry entry; // as stored in the parent, the root's own entry for the root
+		uint64_t contents; // size of everything below it
+	};
+	struct fsck_file
+	{
+		unsigned dir; // index in dirs
+		dir_entry entry;
+		unsigned len; // blocks of the chain that belong to the file
+		int problem;
+		uint32_t bad_block; // where the chain went wrong
+		uint32_t other; // owner of bad_block, for a cross-link
+	};
+	std::vector<fsck_dir> dirs;
+	std::vector<fsck_file> files;
+	unsigned problems = 0;
+
+	//Walk the tree through the dentry cache, the directory blocks are claimed on the way.
+	dirs.push_back({sb.root_block, -1, 0, "/", root->self, 0});
+	std::vector<unsigned> stack(1, 0);
+	while (!stack.empty())
+	{
+		unsigned d = stack.back();
+		stack.pop_back();
+		std::vector<unsigned> block_nos;
+		std::vector<dir_entry> entries;
+		if (dir_blocks(dirs[d].blk, block_nos) || dir_list(dirs[d].blk, entries))
+		{
+			std::cout << "fsck: " << dirs[d].path << ": cannot be read" << std::endl;
+			problems++;
+			continue;
+		}
+		for (auto block_no : block_nos)
+		{
+			uint32_t expected = 0;
+			if (block_no != dirs[d].blk && !owner[block_no].compare_exchange_strong(expected, FSCK_FIRST_ID + d))
+			{
+				std::cout << "fsck: " << dirs[d].path << ": block " << block_no << " is cross-linked" << std::endl;
+				problems++;
+			}
+		}
+		for (auto& entry : entries)
+		{
+			if (entry.type != TYPE_DIR)
+			{
+				files.push_back({d, entry, 0, FSCK_OK, 0, 0});
+				continue;
+			}
+			std::string path = dirs[d].path + entry_name(entry);
+			uint32_t blk = entry.first_blk;
+			uint32_t expected = 0;
+			if (blk <= sb.root_block || blk >= sb.no_blocks || fat[blk] == FAT_FREE)
+			{
+				std::cout << "fsck: " << path << ": directory starts at bad block " << blk << std::endl;
+				problems++;
+				if (repair)
+				{
+					dir_remove(dirs[d].blk, entry_name(entry));
+					checkpoint();
+				}
+				continue;
+			}
+			if (!owner[blk].compare_exchange_strong(expected, FSCK_FIRST_ID + dirs.size()))
+			{
+				std::cout << "fsck: " << path << ": directory block " << blk << " is already in use" << std::endl;
+				problems++;
+				if (repair)
+				{
+					dir_remove(dirs[d].blk, entry_name(entry));
+					checkpoint();
+				}
+				continue;
+			}
+			stack.push_back(dirs.size());
+			dirs.push_back({blk, (int)d, d == 0 ? (unsigned)dirs.size() : dirs[d].top, path + "/", entry, 0});
+		}
+	}
+	uint32_t first_file_id = FSCK_FIRST_ID + dirs.size();
+
+	//The subtrees below the root are checked in parallel, one per worker at a time.
+	std::vector<std::vector<unsigned>> subtrees(dirs.size());
+	for (unsigned f = 0; f < files.size(); f++)
+		subtrees[dirs[files[f].dir].top].push_back(f);
+	subtrees.erase(std::remove_if(subtrees.begin(), subtrees.end(), [](const std::vector<unsigned>& s) { return s.empty(); }), subtrees.end());
+	unsigned nthreads = std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned)std::max(subtrees.size(), (size_t)1)));
+
+	//Follow the chain of every file. A block is claimed with a compare and swap, so a block reached twice,
+	//from two files or from a cycle, is found whichever thread gets there first. A block with a reference count
+	//may be reached from several files, the first one claims it and the rest of the chain, the others only
+	//count its length.
+	std::atomic<unsigned> next_subtree(0);
+	auto check_chains = [&]()
+	{
+		for (unsigned s; (s = next_subtree++) < subtrees.size();)
+		{
+			for (auto f : subtrees[s])
+			{
+				fsck_file& file = files[f];
+				uint32_t b = file.entry.first_blk;
+				bool shared = false;
+				while (true)
+				{
+					if (b <= sb.root_block || b >= sb.no_blocks || fat[b] == FAT_FREE || file.len >= sb.no_blocks)
+					{
+						file.problem = FSCK_BAD_LINK;
+						file.bad_block = b;
+						break;
+					}
+					uint32_t expected = 0;
+					if (!shared && !owner[b].compare_exchange_strong(expected, first_file_id + f))
+					{
+						if (refs.empty() || refs[b] == 0 || expected < first_file_id)
+						{
+							file.problem = FSCK_CROSS_LINK;
+							file.bad_block = b;
+							file.other = expected;
+							break;
+						}
+						shared = true;
+						arrivals[b]++;
+					}
+					else if (!shared)
+						arrivals[b]++;
+					file.len++;
+					if (fat[b] == FAT_EOF)
+						break;
+					b = fat[b];
+				}
+			}
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < nthreads; i++)
+		workers.emplace_back(check_chains);
+	check_chains();
+	for (auto& worker : workers)
+		worker.join();
+
+	//Blocks in use that nobody owns have leaked, and a block of a file has one reference more than its count.
+	//The FAT is split between the workers.
+	std::vector<std::vector<unsigned>> leaked(nthreads), miscounted(nthreads);
+	unsigned per_thread = (sb.no_blocks + nthreads - 1) / nthreads;
+	workers.clear();
+	for (unsigned t = 0; t < nthreads; t++)
+	{
+		workers.emplace_back([&, t]()
+		{
+			unsigned end = std::min(sb.no_blocks, (t + 1) * per_thread);
+			for (unsigned b = t * per_thread; b < end; b++)
+			{
+				if (fat[b] != FAT_FREE && owner[b] == 0)
+					leaked[t].push_back(b);
+				else if (!refs.empty() && b > sb.root_block && refs[b] + 1u != std::max(arrivals[b].load(), 1u))
+					miscounted[t].push_back(b);
+			}
+		});
+	}
+	for (auto& worker : workers)
+		worker.join();
+
+	unsigned nmiscounted = 0;
+	for (auto& blocks : miscounted)
+	{
+		for (auto block_no : blocks)
+		{
+			if (repair)
+			{
+				set_ref(block_no, std::min(std::max(arrivals[block_no].load(), 1u) - 1, (unsigned)REF_MAX));
+				checkpoint();
+			}
+			nmiscounted++;
+		}
+	}
+	if (nmiscounted > 0)
+	{
+		std::cout << "fsck: " << nmiscounted << " blocks have a wrong reference count" << std::endl;
+		problems++;
+	}
+
+	auto owner_name = [&](uint32_t id) -> std::string
+	{
+		if (id < FSCK_FIRST_ID)
+			return "the file system";
+		if (id < first_file_id)
+			return dirs[id - FSCK_FIRST_ID].path;
+		const fsck_file& file = files[id - first_file_id];
+		return dirs[file.dir].path + entry_name(file.entry);
+	};
+
+	//Report the files, and fix them when asked to. A chain that goes wrong is cut before that block.
+	//Every fix leaves the file system consistent, so the group may be committed between them.
+	for (auto& file : files)
+	{
+		if (repair)
+			checkpoint();
+		std::string name = entry_name(file.entry);
+		std::string path = dirs[file.dir].path + name;
+		uint32_t dir_blk = dirs[file.dir].blk;
+		if (file.problem == FSCK_BAD_LINK)
+			std::cout << "fsck: " << path << ": block " << file.len << " of the chain is bad (" << file.bad_block << ")" << std::endl;
+		else if (file.problem == FSCK_CROSS_LINK)
+			std::cout << "fsck: " << path << ": block " << file.bad_block << " is also used by " << owner_name(file.other) << std::endl;
+		if (file.problem != FSCK_OK)
+		{
+			problems++;
+			if (repair && file.len == 0)
+			{
+				dir_remove(dir_blk, name);
+				file.entry.size = 0;
+				continue;
+			}
+			if (repair)
+			{
+				int last = file.entry.first_blk;
+				for (unsigned i = 1; i < file.len; i++)
+					last = fat[last];
+				set_fat(last, FAT_EOF);
+			}
+		}
+
+		//The chain has one block per started block of data, an empty file still has one.
+		unsigned needed = std::max((uint64_t)1, ((uint64_t)file.entry.size + sb.block_size - 1) / sb.block_size);
+		if (file.len == needed)
+			continue;
+		if (file.problem == FSCK_OK)
+		{
+			std::cout << "fsck: " << path << ": size " << file.entry.size << " needs " << needed << " blocks, the chain has " << file.len << std::endl;
+			problems++;
+		}
+		if (!repair)
+			continue;
+		if (file.len > needed)
+		{
+			//Free the blocks past the end of the data, a shared chain is copied up to there first.
+			if (unshare(dir_blk, file.entry, needed - 1) == -1)
+				continue;
+			int last = file.entry.first_blk;
+			for (unsigned i = 1; i < needed; i++)
+				last = fat[last];
+			int next = fat[last];
+			set_fat(last, FAT_EOF);
+			release_chain(next);
+		}
+		else
+		{
+			file.entry.size = std::min(file.entry.size, file.len * sb.block_size);
+			dir_update(dir_blk, file.entry);
+		}
+	}
+
+	//Directory sizes are the sizes of everything below them, children come after their parents in dirs.
+	for (auto& file : files)
+		dirs[file.dir].contents += file.entry.size;
+	for (size_t d = dirs.size(); d-- > 0;)
+	{
+		if (dirs[d].parent >= 0)
+			dirs[dirs[d].parent].contents += dirs[d].contents;
+	}
+	for (size_t d = 0; d < dirs.size(); d++)
+	{
+		if (repair)
+			checkpoint();
+		if (dirs[d].entry.size == dirs[d].contents)
+			continue;
+		std::cout << "fsck: " << dirs[d].path << ": size " << dirs[d].entry.size << " should be " << dirs[d].contents << std::endl;
+		problems++;
+		if (!repair)
+			continue;
+		dirs[d].entry.size = dirs[d].contents;
+		if (dirs[d].parent < 0)
+			dir_set_self(sb.root_block, dirs[d].entry);
+		else
+			dir_update(dirs[dirs[d].parent].blk, dirs[d].entry);
+	}
+
+	unsigned nleaked = 0;
+	for (auto& blocks : leaked)
+	{
+		for (auto block_no : blocks)
+		{
+			if (repair)
+			{
+				set_fat(block_no, FAT_FREE);
+				checkpoint();
+			}
+			nleaked++;
+		}
+	}
+	if (nleaked > 0)
+	{
+		std::cout << "fsck: " << nleaked << " blocks are in use but belong to no file or directory" << std::endl;
+		problems++;
+	}
+	if (repair)
+	{
+		//Chains may have been cut short.
+		tails.clear();
+		write_fat();
+	}
+
+	std::cout << "fsck: " << dirs.size() << " directories, " << files.size() << " files, " << problems << " problems";
+	if (repair && problems > 0)
+		std::cout << ", repaired";
+	std::cout << std::endl;
+	return problems > 0 && !repair ? 1 : 0;
+}
+
+//Helper functions
+//----------------------------------------------------------------------------
+
+//Writes the content of a file to the host file descriptor out, many blocks per write(2). Returns the number of bytes
+//written or -1.
+int64_t FS::copy_out(std::string filepath, int out)
+{
+	int fd = open(filepath, READ);
+	if (fd == -1)
+		return -1;
+
+	std::vector<uint8_t> buffer((size_t)IO_BATCH_BLOCKS * sb.block_size);
+	uint64_t offset = 0;
+	int64_t n;
+	while ((n = read(fd, buffer.data(), buffer.size(), offset)) > 0)
+	{
+		for (int64_t done = 0; done < n;)
+		{
+			ssize_t written = ::write(out, buffer.data() + done, n - done);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written < 0)
+			{
+				close(fd);
+				return -1;
+			}
+			done += written;
+		}
+		offset += n;
+	}
+	close(fd);
+	return n < 0 ? -1 : offset;
+}
+
+//Creates a new file with the data fill gives. fill copies up to len bytes to buf and returns how many, 0 at the end
+//of the data or -1 on an error. The data is written one batch of blocks at a time and the blocks are allocated as it
+//goes, so only one batch is ever held in memory however large the file is.
+int FS::create_from(std::string filepath, const std::function<int64_t(uint8_t*, size_t)>& fill)
+{
+	op_guard op(*this);
+	if (op.failed)
+		return -1;
+
+	//Check if the filepath entered already exists.
+	if (find_dir_entry(filepath).file_name[0] != '\0')
+	{
+		std::cerr << "Error! That file or directory already exists." << std::endl;
+		return -1;
+	}
+
+	//The directories from the root down to the one the file goes in, everything before the last slash.
+	std::vector<dir_entry> parents;
+	size_t lastslash = filepath.find_last_of("/");
+	if (lastslash == std::string::npos)
+		resolve(this->path, parents);
+	else
+		resolve(filepath.substr(0, lastslash + 1), parents);
+	if (parents.empty() || parents.back().type != TYPE_DIR)
+	{
+		std::cerr << "Error! The directory does not exist." << std::endl;
+		return -1;
+	}
+
+	//Create the directory entry for the new file.
+	dir_entry fentry;
+	filepath.substr(lastslash + 1).copy(fentry.file_name, sizeof(fentry.file_name));
+	fentry.access_rights = READ | WRITE | EXECUTE;
+	fentry.type = TYPE_FILE;
+
+	//Gives back the blocks written so far when the file cannot be created.
+	int first = -1, last = -1;
+	auto discard = [&]()
+	{
+		for (int block_no = first; block_no != -1;)
+		{
+			int next = block_no == last ? -1 : fat[block_no];
+			set_fat(block_no, FAT_FREE);
+			block_no = next;
+		}
+		write_fat();
+		return -1;
+	};
+
+	std::vector<uint8_t> batch((size_t)IO_BATCH_BLOCKS * sb.block_size);
+	uint64_t size = 0;
+	bool done = false;
+	while (!done)
+	{
+		//Fill the batch, a short read does not end the data.
+		size_t len = 0;
+		while (len < batch.size())
+		{
+			int64_t n = fill(batch.data() + len, batch.size() - len);
+			if (n < 0)
+			{
+				std::cerr << "Error! Could not read the data." << std::endl;
+				return discard();
+			}
+			if (n == 0)
+			{
+				done = true;
+				break;
+			}
+			len += n;
+		}
+		//An empty file still gets a block.
+		if (len == 0 && first != -1)
+			break;
+		size += len;
+		if (size > UINT32_MAX)
+		{
+			std::cerr << "Error! The file is too large." << std::endl;
+			return discard();
+		}
+
+		//The last block is zero padded.
+		size_t nblocks = std::max((size_t)1, (len + sb.block_size - 1) / sb.block_size);
+		std::fill(batch.begin() + len, batch.begin() + nblocks * sb.block_size, 0);
+		std::vector<int> spots = find_multiple_empty(nblocks);
+		if (spots[0] == -1)
+		{
+			std::cerr << "ERROR! Not enough empty spots in the FAT." << std::endl;
+			return discard();
+		}
+
+		//Write the batch with vectored I/O, one call per contiguous run.
+		std::vector<unsigned> block_nos(spots.begin(), spots.end());
+		std::vector<const uint8_t*> blks;
+		for (size_t i = 0; i < nblocks; i++)
+			blks.push_back(batch.data() + i * sb.block_size);
+		if (cache.write_blocks(block_nos, blks))
+		{
+			std::cerr << "ERROR! Could not write the file data." << std::endl;
+			return discard();
+		}
+
+		//Link the batch to the end of the chain, so the next batch and a directory that grows cannot take its blocks.
+		//No entry reaches the chain yet, a commit on the way at worst leaves its blocks allocated.
+		for (auto block_no : spots)
+		{
+			set_fat(block_no, FAT_EOF);
+			if (first == -1)
+				first = block_no;
+			else
+				set_fat(last, block_no);
+			last = block_no;
+			if (checkpoint())
+				return discard();
+		}
+	}
+	fentry.first_blk = first;
+	fentry.size = size;
+
+	//Put the new file in its directory.
+	if (dir_insert(parents.back().first_blk, fentry))
+	{
+		std::cerr << "ERROR! No more space for dir_entries in the current directory." << std::endl;
+		return discard();
+	}
+
+	//Update all the sizes in the hierarchy.
+	add_size(parents, fentry.size);
+
+	//Uppdate the FAT ON THE DISK.
+	write_fat();
+	return 0;
+}
+
+//Helper function to find an empty spot for the new file. Called in create
+int FS::find_empty()
+{
+	return find_multiple_empty(1)[0];
+}
+
+//Returns the first block of a free run of numBlocks blocks chosen with the allocation policy, or -1 if no run is large enough.
+int FS::find_free_run(unsigned numBlocks, int policy)
+{
+	//After the superblock, FAT and root entries.
+	unsigned first = sb.root_block + 1;
+	unsigned start = first;
+	if (policy == ALLOC_NEXT_FIT && next_fit > first && next_fit < sb.no_blocks)
+		start = next_fit;
+
+	//Step from free run to free run, next fit wraps around to the start of the disk once.
+	int found = -1;
+	unsigned found_len = 0;
+	bool wrapped = false;
+	int pos = free_map.find_next(start);
+	while (true)
+	{
+		if (pos == -1 || (wrapped && (unsigned)pos >= start))
+		{
+			if (wrapped || start == first)
+				break;
+			wrapped = true;
+			pos = free_map.find_next(first);
+			continue;
+		}
+		unsigned len = free_map.run_length(pos, sb.no_blocks);
+		if (len >= numBlocks)
+		{
+			if (policy != ALLOC_BEST_FIT)
+				return pos;
+			if (found == -1 || len < found_len)
+			{
+				found = pos;
+				found_len = len;
+			}
+			//Nothing fits better than an exact fit.
+			if (len == numBlocks)
+				break;
+		}
+		pos = free_map.find_next(pos + len);
+	}
+	return found;
+}
+
+//Helper function to find multiple empty spots for the new file. Called in create
+//One free run that fits all the blocks is searched for with the allocation policy, so the file ends up contiguous.
+std::vector<int> FS::find_multiple_empty(int numBlocks)
+{
+	std::vector<int> empty_spots(numBlocks);
+	//The free block count tells up front if there is room, without scanning the FAT.
+	if (free_map.get_free() < (unsigned)numBlocks)
+	{
+		empty_spots[0] = -1;
+		return empty_spots;
+	}
+
+	int found = find_free_run(numBlocks, alloc_policy);
+	if (found != -1)
+	{
+		for (int i = 0; i < numBlocks; i++)
+			empty_spots[i] = found + i;
+	}
+	else
+	{
+		//No run is large enough, take the free blocks in disk order.
+		int j = sb.root_block + 1;
+		for (int i = 0; i < numBlocks; i++)
+		{
+			empty_spots[i] = free_map.find_next(j);
+			j = empty_spots[i] + 1;
+		}
+	}
+	next_fit = empty_spots[numBlocks - 1] + 1;
+
+	return empty_spots;
+}
+
+//Counts the files below the directory in dir_blk and the extents, runs of consecutive blocks, they are stored in.
+void FS::count_extents(unsigned dir_blk, unsigned& files, unsigned& extents)
+{
+	std::vector<dir_entry> entries;
+	dir_list(dir_blk, entries);
+	for (auto& entry : entries)
+	{
+		if (entry.type == TYPE_DIR)
+		{
+			count_extents(entry.first_blk, files, extents);
+			continue;
+		}
+		files++;
+		//Every block that does not follow the previous one starts a new extent.
+		extents++;
+		for (int j = entry.first_blk; fat[j] != FAT_EOF; j = fat[j])
+			if (fat[j] != j + 1)
+				extents++;
+	}
+}
+
+//Moves the next blocks of the file called name in the directory in dir_blk to the free run defrag moves it to, at
+//most IO_BATCH_BLOCKS of them. Each step copies the data before the FAT points at it, links the copies in place of
+//the old blocks and frees those last, so the file is whole after every step. The run is chosen on the first step,
+//and the file is checked again on the first step of a call, it may have changed since the last one.
+//Returns 0 after a step, 2 once the whole file is in the run, 1 if no free run is large enough for the file, it
+//shares blocks with other files and moving it would unshare them, or it is gone, or -1.
+int FS::relocate(unsigned dir_blk, const std::string& name)
+{
+	const dentry* found_entry = lookup(dir_blk, name);
+	if (found_entry == nullptr || found_entry->entry.type != TYPE_FILE)
+		return 1;
+	dir_entry entry = found_entry->entry;
+	if (!defrag.checked)
+	{
+		defrag.checked = true;
+		if (shares_blocks(entry.first_blk))
+			return 1;
+		//The blocks moved so far must still start the chain, and it must have the same length.
+		unsigned blocks = 0;
+		bool in_run = true;
+		for (int i = entry.first_blk; i != FAT_EOF; i = fat[i], blocks++)
+			if (blocks < defrag.moved && (unsigned)i != defrag.target + blocks)
+				in_run = false;
+		if (blocks != defrag.blocks || !in_run)
+			defrag.moved = 0;
+		if (defrag.moved == 0)
+		{
+			int found = find_free_run(blocks, ALLOC_BEST_FIT);
+			if (found == -1)
+				return 1;
+			defrag.target = found;
+			defrag.blocks = blocks;
+		}
+	}
+
+	//The blocks after the ones in the run, their places in the run must still be free.
+	unsigned len = std::min(defrag.blocks - defrag.moved, (unsigned)IO_BATCH_BLOCKS);
+	int prev = defrag.moved == 0 ? -1 : (int)(defrag.target + defrag.moved - 1);
+	std::vector<unsigned> old_nos, dest_nos;
+	for (int i = prev == -1 ? entry.first_blk : fat[prev]; old_nos.size() < len; i = fat[i])
+	{
+		old_nos.push_back(i);
+		dest_nos.push_back(defrag.target + defrag.moved + dest_nos.size());
+		if (fat[dest_nos.back()] != FAT_FREE)
+		{
+			defrag.checked = false;
+			defrag.moved = 0;
+			return 0;
+		}
+	}
+	int32_t rest = fat[old_nos.back()];
+
+	//Copy the data with vectored I/O, dirty cached blocks are read from the cache.
+	std::vector<uint8_t> buffer((size_t)len * sb.block_size);
+	std::vector<uint8_t*> reads;
+	std::vector<const uint8_t*> writes;
+	for (unsigned j = 0; j < len; j++)
+	{
+		reads.push_back(buffer.data() + (size_t)j * sb.block_size);
+		writes.push_back(buffer.data() + (size_t)j * sb.block_size);
+	}
+	if (cache.read_blocks(old_nos, reads) || cache.write_blocks(dest_nos, writes))
+	{
+		std::cerr << "Error! Could not move the file data." << std::endl;
+		return -1;
+	}
+
+	//Link the copies from the back, nothing reaches them until the block before them or the directory entry does.
+	for (unsigned j = len; j-- > 0;)
+	{
+		set_fat(dest_nos[j], j + 1 < len ? (int32_t)dest_nos[j + 1] : rest);
+		if (checkpoint())
+			return -1;
+	}
+	tails.erase(entry.first_blk);
+	cow_gen++;
+	if (prev == -1)
+	{
+		entry.first_blk = defrag.target;
+		if (write_fat() || dir_update(dir_blk, entry))
+			return -1;
+	}
+	else
+	{
+		set_fat(prev, dest_nos[0]);
+		if (write_fat())
+			return -1;
+	}
+
+	//Then free the old blocks, their cached copies are not needed anymore.
+	cache.discard(old_nos);
+	for (auto block_no : old_nos)
+	{
+		set_fat(block_no, FAT_FREE);
+		if (checkpoint())
+			return -1;
+	}
+	if (write_fat())
+		return -1;
+	defrag.moved += len;
+	return defrag.moved == defrag.blocks ? 2 : 0;
+}
+
+//Directory helpers
+//----------------------------------------------------------------------------
+
+//The largest power of two number of buckets whose block numbers fit in a header block.
+unsigned FS::max_buckets()
+{
+	unsigned fit = (sb.block_size - sizeof(dir_entry) - sizeof(hdir_header)) / sizeof(uint32_t);
+	unsigned n = HDIR_MIN_BUCKETS;
+	while (n * 2 <= fit)
+		n *= 2;
+	return n;
+}
+
+//Returns the cached directory in dir_blk, reading its first block if it is not cached.
+//The entries of a bucket are cached when they are first needed, a linear directory is its only bucket.
+FS::dir_cache* FS::load_dir(unsigned dir_blk)
+{
+	if (check_loaded())
+		return nullptr;
+	auto it = dcache.find(dir_blk);
+	if (it != dcache.end())
+	{
+		dcache_hits++;
+		return &it->second;
+	}
+	dcache_misses++;
+
+	std::vector<uint8_t> block(sb.block_size, 0);
+	if (cache.read(dir_blk, block.data()))
+		return nullptr;
+	//Keep the memory bounded, the cache simply starts over when it is full.
+	if (dcache.size() >= DCACHE_DIRS)
+		dcache.clear();
+	dir_entry* dirblock = (dir_entry*)block.data();
+	dir_cache& dir = dcache[dir_blk];
+	dir.self = dirblock[0];
+
+	hdir_header* header = (hdir_header*)(block.data() + sizeof(dir_entry));
+	dir.hashed = header->magic == HDIR_MAGIC && header->nbuckets >= 1 && header->nbuckets <= max_buckets();
+	if (dir.hashed)
+	{
+		uint32_t* table = (uint32_t*)(header + 1);
+		dir.buckets.assign(table, table + header->nbuckets);
+	}
+	else
+		dir.buckets.assign(1, dir_blk);
+	dir.heads = dir.buckets;
+	std::sort(dir.heads.begin(), dir.heads.end());
+	dir.loaded.assign(dir.buckets.size(), false);
+	dir.free_hint.assign(dir.buckets.size(), 0);
+	if (!dir.hashed && load_bucket(dir, 0))
+	{
+		dcache.erase(dir_blk);
+		return nullptr;
+	}
+	return &dir;
+}
+
+//Returns the blocks of one bucket, its first block followed by the overflow blocks chained to it in the FAT.
+//The chain stops at the first block of another bucket, which is how older hashed directories link their buckets.
+std::vector<unsigned> FS::bucket_chain(const dir_cache& dir, unsigned bucket)
+{
+	std::vector<unsigned> chain(1, dir.buckets[bucket]);
+	int32_t next = fat_at(chain.back());
+	while (next > 0 && (unsigned)next < sb.no_blocks && chain.size() < sb.no_blocks
+		&& !std::binary_search(dir.heads.begin(), dir.heads.end(), (uint32_t)next))
+	{
+		chain.push_back(next);
+		next = fat_at(next);
+	}
+	return chain;
+}
+
+//Caches the entries of one bucket, slot 0 of a linear directory is not an entry.
+int FS::load_bucket(dir_cache& dir, unsigned bucket)
+{
+	std::vector<unsigned> chain = bucket_chain(dir, bucket);
+	std::vector<uint8_t> buffer(chain.size() * sb.block_size, 0);
+	std::vector<uint8_t*> blks;
+	for (size_t i = 0; i < chain.size(); i++)
+		blks.push_back(buffer.data() + i * sb.block_size);
+	//A chain cut short because its FAT block could not be read would cache only some of the entries.
+	if (load_failed || cache.read_blocks(chain, blks))
+		return -1;
+	for (size_t i = 0; i < chain.size(); i++)
+	{
+		dir_entry* dirblock = (dir_entry*)blks[i];
+		for (unsigned j = (i == 0 && !dir.hashed) ? 1 : 0; j < dir_entries(); j++)
+		{
+			if (dirblock[j].file_name[0] == '\0')
+				continue;
+			dentry& d = dir.entries[entry_name(dirblock[j])];
+			d.entry = dirblock[j];
+			d.block = chain[i];
+			d.slot = j;
+		}
+	}
+	dir.loaded[bucket] = true;
+	return 0;
+}
+
+//The bucket a name belongs to in a hashed directory, always 0 in a linear one.
+unsigned FS::bucket_of(const dir_cache& dir, const std::string& name)
+{
+	return name_hash(name) & (dir.buckets.size() - 1);
+}
+
+//Returns the entry called name in the directory in dir_blk, or nullptr if there is none.
+//This reads at most the directory's first block and one bucket, the pointer is valid until the directory changes.
+FS::dentry* FS::lookup(unsigned dir_blk, const std::string& name)
+{
+	dir_cache* dir = load_dir(dir_blk);
+	if (dir == nullptr)
+		return nullptr;
+	unsigned bucket = bucket_of(*dir, name);
+	if (!dir->loaded[bucket] && load_bucket(*dir, bucket))
+		return nullptr;
+	auto it = dir->entries.find(name);
+	if (it == dir->entries.end())
+		return nullptr;
+	return &it->second;
+}
+
+//Writes an empty linear directory to dir_blk, self goes in slot 0.
+int FS::dir_init(unsigned dir_blk, const dir_entry& self)
+{
+	std::vector<uint8_t> block(sb.block_size, 0);
+	((dir_entry*)block.data())[0] = self;
+	dcache.erase(dir_blk);
+	return meta_write(dir_blk, block.data());
+}
+
+//Gets every block of the directory in dir_blk, the first block followed by the blocks of each bucket.
+int FS::dir_blocks(unsigned dir_blk, std::vector<unsigned>& block_nos)
+{
+	dir_cache* dir = load_dir(dir_blk);
+	if (dir == nullptr)
+		return -1;
+	if (dir->hashed)
+		block_nos.push_back(dir_blk);
+	for (unsigned i = 0; i < dir->buckets.size(); i++)
+	{
+		std::vector<unsigned> chain = bucket_chain(*dir, i);
+		block_nos.insert(block_nos.end(), chain.begin(), chain.end());
+	}
+	return 0;
+}
+
+//Gets all entries of the directory in dir_blk except slot 0, in the order they are stored.
+int FS::dir_list(unsigned dir_blk, std::vector<dir_entry>& entries)
+{
+	std::vector<unsigned> block_nos;
+	if (dir_blocks(dir_blk, block_nos))
+		return -1;
+	//Only the entries are listed, not the header of a hashed directory.
+	unsigned first = 0;
+	if (load_dir(dir_blk)->hashed)
+		block_nos.erase(block_nos.begin());
+	else
+		first = 1;
+
+	//All blocks are read with vectored I/O.
+	std::vector<uint8_t> buffer(block_nos.size() * sb.block_size, 0);
+	std::vector<uint8_t*> blks;
+	for (size_t i = 0; i < block_nos.size(); i++)
+		blks.push_back(buffer.data() + i * sb.block_size);
+	if (cache.read_blocks(block_nos, blks))
+		return -1;
+	for (size_t i = 0; i < block_nos.size(); i++)
+	{
+		dir_entry* dirblock = (dir_entry*)blks[i];
+		for (unsigned j = block_nos[i] == dir_blk ? first : 0; j < dir_entries(); j++)
+			if (dirblock[j].file_name[0] != '\0')
+				entries.push_back(dirblock[j]);
+	}
+	return 0;
+}
+
+//Turns the directory in dir_blk into a hashed directory with nbuckets buckets, or more if a bucket would overflow.
+//Once the header has no room for more buckets, a bucket gets as many chained blocks as its entries need.
+//A linear directory keeps its first block as the header block, so the entry pointing at it stays valid.
+int FS::hash_dir(unsigned dir_blk, unsigned nbuckets)
+{
+	std::vector<dir_entry> entries;
+	std::vector<unsigned> old_nos;
+	if (dir_list(dir_blk, entries) || dir_blocks(dir_blk, old_nos))
+		return -1;
+	//The header block is reused.
+	old_nos.erase(std::remove(old_nos.begin(), old_nos.end(), dir_blk), old_nos.end());
+
+	//Spread the entries over the buckets, with more buckets until none overflows.
+	nbuckets = std::min(nbuckets, max_buckets());
+	std::vector<unsigned> fill;
+	while (true)
+	{
+		fill.assign(nbuckets, 0);
+		bool overflow = false;
+		for (auto& entry : entries)
+			if (++fill[name_hash(entry_name(entry)) & (nbuckets - 1)] > dir_entries())
+				overflow = true;
+		if (!overflow || nbuckets * 2 > max_buckets())
+			break;
+		nbuckets *= 2;
+	}
+
+	//Bucket i is stored in blocks first[i] to first[i + 1] - 1 of the new blocks.
+	std::vector<unsigned> first(nbuckets + 1, 0);
+	for (unsigned i = 0; i < nbuckets; i++)
+		first[i + 1] = first[i] + std::max(1u, (fill[i] + dir_entries() - 1) / dir_entries());
+	std::vector<int> new_nos = find_multiple_empty(first[nbuckets]);
+	if (new_nos[0] == -1)
+		return -1;
+
+	//Build the buckets in memory and write them, packed from their first slot.
+	dir_cache dir;
+	dir.hashed = true;
+	for (unsigned i = 0; i < nbuckets; i++)
+		dir.buckets.push_back(new_nos[first[i]]);
+	dir.heads = dir.buckets;
+	std::sort(dir.heads.begin(), dir.heads.end());
+	dir.loaded.assign(nbuckets, true);
+	std::vector<uint8_t> buffer(new_nos.size() * sb.block_size, 0);
+	fill.assign(nbuckets, 0);
+	for (auto& entry : entries)
+	{
+		std::string name = entry_name(entry);
+		unsigned bucket = name_hash(name) & (nbuckets - 1);
+		unsigned pos = fill[bucket]++;
+		unsigned i = first[bucket] + pos / dir_entries();
+		((dir_entry*)(buffer.data() + (size_t)i * sb.block_size))[pos % dir_entries()] = entry;
+		dentry& d = dir.entries[name];
+		d.entry = entry;
+		d.block = new_nos[i];
+		d.slot = pos % dir_entries();
+	}
+	dir.free_hint = fill;
+
+	//Every bucket is its own chain. Nothing reaches the new blocks until the header does, so the group may be
+	//committed while they are written.
+	for (unsigned i = 0; i < nbuckets; i++)
+	{
+		for (unsigned j = first[i]; j + 1 < first[i + 1]; j++)
+			set_fat(new_nos[j], new_nos[j + 1]);
+		set_fat(new_nos[first[i + 1] - 1], FAT_EOF);
+	}
+	for (size_t i = 0; i < new_nos.size(); i++)
+		if (meta_write(new_nos[i], buffer.data() + i * sb.block_size) || checkpoint())
+			return -1;
+
+	//Then the header, which points at the new buckets from now on.
+	std::vector<uint8_t> block(sb.block_size, 0);
+	if (cache.read(dir_blk, block.data()))
+		return -1;
+	dir.self = ((dir_entry*)block.data())[0];
+	std::fill(block.begin() + sizeof(dir_entry), block.end(), 0);
+	hdir_header* header = (hdir_header*)(block.data() + sizeof(dir_entry));
+	header->magic = HDIR_MAGIC;
+	header->nbuckets = nbuckets;
+	std::copy(dir.buckets.begin(), dir.buckets.end(), (uint32_t*)(header + 1));
+	if (meta_write(dir_blk, block.data()))
+		return -1;
+	set_fat(dir_blk, FAT_EOF);
+	dcache[dir_blk] = dir;
+	if (write_fat())
+		return -1;
+
+	//The old blocks are freed.
+	cache.discard(old_nos);
+	for (auto block_no : old_nos)
+	{
+		set_fat(block_no, FAT_FREE);
+		if (checkpoint())
+			return -1;
+	}
+	return write_fat();
+}
+
+//Adds entry to the directory in dir_blk, the name must not be in use.
+//The search for a free slot starts at the bucket's free-slot hint. A full linear directory is turned into a
+//hashed one, a hashed directory doubles its buckets when a bucket is full and chains a block to the bucket
+//once the header has no room for more buckets.
+int FS::dir_insert(unsigned dir_blk, const dir_entry& entry)
+{
+	dir_cache* dir = load_dir(dir_blk);
+	if (dir == nullptr)
+		return -1;
+	std::string name = entry_name(entry);
+	std::vector<uint8_t> block(sb.block_size, 0);
+	dir_entry* dirblock = (dir_entry*)block.data();
+
+	while (true)
+	{
+		unsigned bucket = bucket_of(*dir, name);
+		if (!dir->loaded[bucket] && load_bucket(*dir, bucket))
+			return -1;
+		std::vector<unsigned> chain = bucket_chain(*dir, bucket);
+		//Every slot before the hint is in use, slot 0 of a linear directory is never free.
+		unsigned pos = std::max(dir->free_hint[bucket], dir->hashed ? 0u : 1u);
+		for (unsigned i = pos / dir_entries(); i < chain.size(); i++)
+		{
+			if (cache.read(chain[i], block.data()))
+				return -1;
+			for (unsigned k = i == pos / dir_entries() ? pos % dir_entries() : 0; k < dir_entries(); k++)
+			{
+				if (dirblock[k].file_name[0] != '\0')
+					continue;
+				dirblock[k] = entry;
+				dentry& d = dir->entries[name];
+				d.entry = entry;
+				d.block = chain[i];
+				d.slot = k;
+				dir->free_hint[bucket] = i * dir_entries() + k + 1;
+				return meta_write(chain[i], block.data());
+			}
+		}
+		dir->free_hint[bucket] = chain.size() * dir_entries();
+
+		//The bucket is full.
+		if (!dir->hashed || dir->buckets.size() * 2 <= max_buckets())
+		{
+			if (hash_dir(dir_blk, dir->hashed ? dir->buckets.size() * 2 : HDIR_MIN_BUCKETS))
+				return -1;
+			dir = load_dir(dir_blk);
+			continue;
+		}
+		int block_no = find_empty();
+		if (block_no == -1)
+		{
+			std::cerr << "Error! No free block for the directory." << std::endl;
+			return -1;
+		}
+		std::fill(block.begin(), block.end(), 0);
+		dirblock[0] = entry;
+		if (meta_write(block_no, block.data()))
+			return -1;
+		set_fat(chain.back(), block_no);
+		set_fat(block_no, FAT_EOF);
+		dentry& d = dir->entries[name];
+		d.entry = entry;
+		d.block = block_no;
+		d.slot = 0;
+		dir->free_hint[bucket] = chain.size() * dir_entries() + 1;
+		return write_fat();
+	}
+}
+
+//Replaces the entry with the same name as entry in the directory in dir_blk.
+int FS::dir_update(unsigned dir_blk, const dir_entry& entry)
+{
+	dentry* d = lookup(dir_blk, entry_name(entry));
+	if (d == nullptr)
+		return -1;
+	std::vector<uint8_t> block(sb.block_size, 0);
+	if (cache.read(d->block, block.data()))
+		return -1;
+	((dir_entry*)block.data())[d->slot] = entry;
+	d->entry = entry;
+	return meta_write(d->block, block.data());
+}
+
+//Removes the entry called name from the directory in dir_blk, the freed slot moves the free-slot hint back.
+//Emptied overflow blocks stay in the bucket for later inserts.
+int FS::dir_remove(unsigned dir_blk, const std::string& name)
+{
+	dentry* d = lookup(dir_blk, name);
+	if (d == nullptr)
+		return -1;
+	std::vector<uint8_t> block(sb.block_size, 0);
+	if (cache.read(d->block, block.data()))
+		return -1;
+	((dir_entry*)block.data())[d->slot] = dir_entry();
+	unsigned block_no = d->block;
+	unsigned slot = d->slot;
+	dir_cache* dir = load_dir(dir_blk);
+	dir->entries.erase(name);
+	unsigned bucket = bucket_of(*dir, name);
+	std::vector<unsigned> chain = bucket_chain(*dir, bucket);
+	unsigned i = std::find(chain.begin(), chain.end(), block_no) - chain.begin();
+	dir->free_hint[bucket] = std::min(dir->free_hint[bucket], i * dir_entries() + slot);
+	return meta_write(block_no, block.data());
+}
+
+//Replaces slot 0 of the directory in dir_blk, the directory's own entry or its parent.
+int FS::dir_set_self(unsigned dir_blk, const dir_entry& self)
+{
+	std::vector<uint8_t> block(sb.block_size, 0);
+	if (cache.read(dir_blk, block.data()))
+		return -1;
+	((dir_entry*)block.data())[0] = self;
+	auto it = dcache.find(dir_blk);
+	if (it != dcache.end())
+		it->second.self = self;
+	return meta_write(dir_blk, block.data());
+}
+
+//Resolves filepath component by component from the root, chain gets the entry of every directory on the way
+//and of filepath itself, the root first. Returns -1 if filepath does not exist.
+int FS::resolve(std::string filepath, std::vector<dir_entry>& chain)
+{
+	chain.clear();
+	//Relative paths start in the current directory.
+	if (filepath.empty() || filepath[0] != '/')
+		filepath = path + filepath;
+
+	//The root's own entry is the first one in the root block.
+	dir_cache* root = load_dir(sb.root_block);
+	if (root == nullptr)
+		return -1;
+
+	//The entries of all directories on the way, so that ".." can go back up.
+	std::vector<dir_entry> walked(1, root->self);
+
+	std::string name;
+	size_t start_i = 0, end_i = 0;
+	while (start_i < filepath.size())
+	{
+		end_i = filepath.find('/', start_i);
+		if (end_i == std::string::npos)
+			end_i = filepath.size();
+		name.assign(filepath, start_i, end_i - start_i);
+		start_i = end_i + 1;
+
+		if (name.empty() || name == ".")
+			continue;
+		if (name == "..")
+		{
+			if (walked.size() > 1)
+				walked.pop_back();
+			continue;
+		}
+		if (walked.back().type != TYPE_DIR)
+			return -1;
+
+		//Check if dir_entry name exists in this folder, through the dentry cache.
+		const dentry* found = lookup(walked.back().first_blk, name);
+		if (found == nullptr)
+			return -1;
+		walked.push_back(found->entry);
+	}
+	chain.swap(walked);
+	return 0;
+}
+
+//Returns the dir_entry of filepath, or an empty dir_entry if it does not exist.
+//The path is resolved component by component from the root, so it no longer
+//depends on empty root slots pointing at block 0, which is now the superblock.
+dir_entry FS::find_dir_entry(std::string filepath)
+{
+	std::vector<dir_entry> chain;
+	if (resolve(filepath, chain))
+		return dir_entry();
+	return chain.back();
+}
+
+//Adds delta to the size of every directory in chain, a chain from resolve(), and of the file at its end.
+//The file is updated at once. The directories are only noted, so many changes below a directory add up
+//to one update of each directory when flush_sizes() runs.
+int FS::add_size(const std::vector<dir_entry>& chain, int64_t delta)
+{
+	for (size_t i = 0; i < chain.size(); i++)
+	{
+		if (chain[i].type == TYPE_DIR)
+		{
+			size_delta& pending = size_deltas[chain[i].first_blk];
+			pending.parent_blk = i > 0 ? chain[i - 1].first_blk : sb.root_block;
+			pending.name = entry_name(chain[i]);
+			pending.delta += delta;
+			continue;
+		}
+		if (i == 0)
+			return -1;
+		dentry* d = lookup(chain[i - 1].first_blk, entry_name(chain[i]));
+		if (d == nullptr)
+			return -1;
+		dir_entry file = d->entry;
+		file.size += delta;
+		if (dir_update(chain[i - 1].first_blk, file))
+			return -1;
+	}
+	return 0;
+}
+
+//Writes the directory sizes add_size() noted. A directory that is gone, or whose entry now points
+//at another directory, is skipped.
+int FS::flush_sizes()
+{
+	int ret = 0;
+	for (auto& it : size_deltas)
+	{
+		if (it.second.delta == 0)
+			continue;
+		if (it.first == sb.root_block)
+		{
+			dir_cache* root = load_dir(sb.root_block);
+			if (root == nullptr)
+			{
+				ret = -1;
+				continue;
+			}
+			dir_entry self = root->self;
+			self.size += it.second.delta;
+			if (dir_set_self(sb.root_block, self))
+				ret = -1;
+			continue;
+		}
+		dentry* d = lookup(it.second.parent_blk, it.second.name);
+		if (d == nullptr || d->entry.first_blk != it.first)
+			continue;
+		dir_entry dir = d->entry;
+		dir.size += it.second.delta;
+		if (dir_update(it.second.parent_blk, dir))
+			ret = -1;
+	}
+	size_deltas.clear();
+	return ret;
 }
\ No newline at end of file
@@ -5,33 +5,158 @@
 #include <cstring>
 #include <array>
 #include <algorithm>
+#include <memory>
+#include <chrono>
+#include <unordered_map>
+#include <set>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include "disk.h"
+#include "cache.h"
+#include "aio.h"
+#include "freemap.h"
 
 #ifndef __FS_H__
 #define __FS_H__
 
-#define ROOT_BLOCK 0
-#define FAT_BLOCK 1
+#define SUPER_BLOCK 0
 #define FAT_FREE 0
 #define FAT_EOF -1
 
+#define FS_MAGIC 0x31534654 // "TFS1"
+#define FS_VERSION 4
+// block sizes are powers of two in this range
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MIN_NO_BLOCKS 16
+// FAT entries are signed 32-bit block numbers
+#define MAX_NO_BLOCKS 0x7fffffff
+
 #define TYPE_FILE 0
 #define TYPE_DIR 1
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
 
+// number of blocks moved per vectored read/write when copying file data
+#define IO_BATCH_BLOCKS 256
+
+// number of directories the dentry cache keeps the entries of
+#define DCACHE_DIRS 1024
+
+// number of files the last block is remembered for
+#define TAIL_CACHE_FILES 1024
+
+// an open file indexes at most this many blocks of its FAT chain, larger
+// files index every 2nd, 4th, ... block
+#define FILE_INDEX_BLOCKS 65536
+
+// allocation policies for file data, each tries to find one free run
+// that fits the whole file before falling back to scattered blocks
+#define ALLOC_FIRST_FIT 0 // the first run that is large enough
+#define ALLOC_NEXT_FIT 1 // the first large enough run after the previous allocation
+#define ALLOC_BEST_FIT 2 // the smallest run that is large enough
+
+// the superblock is stored at the start of block 0 and describes the
+// geometry and the layout of the file system
+struct superblock
+{
+    uint32_t magic; // FS_MAGIC
+    uint32_t version; // FS_VERSION
+    uint32_t block_size; // size of a block in bytes
+    uint32_t no_blocks; // number of blocks on the disk
+    uint32_t fat_block; // first block of the FAT
+    uint32_t fat_blocks; // number of blocks in the FAT
+    uint32_t root_block; // block of the root directory
+    // version 3, a version 2 file system has no journal
+    uint32_t journal_block; // first block of the journal, after the FAT
+    uint32_t journal_blocks; // number of blocks in the journal
+    // version 4, older file systems copy files instead of sharing blocks
+    uint32_t ref_block; // first block of the reference counts, after the journal
+    uint32_t ref_blocks; // number of blocks of reference counts
+};
+
+// Files copied with cp share their blocks. For every block the reference
+// count table holds how many more references it has than the one it has
+// when it is not shared, as a 16-bit count; a reference is a directory
+// entry or a FAT entry leading to the block. A chain shared from some
+// block on is shared to its end, so a file owns its blocks up to the first
+// one with a count, and writing to the shared part copies it first.
+#define REF_MAX 0xffff
+
+// The journal holds at most one transaction, the metadata blocks (FAT,
+// directories, superblock) changed by a group of operations. It is a
+// descriptor block, a journal_header followed by the home block numbers,
+// then a copy of each block and a commit block, a journal_header with
+// the checksum of the descriptor and the copies. The blocks are written
+// home once the commit block is on the disk, and a transaction with a
+// valid commit block is written home again on mount.
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define JOURNAL_COMMIT_MAGIC 0x54494d43 // "CMIT"
+// the journal takes 1/64 of the disk, within these bounds
+#define JOURNAL_MIN_BLOCKS 6
+#define JOURNAL_MAX_BLOCKS 1024
+// a group of operations is committed once it has this many operations,
+// or this long after the first one in the group ended
+#define JOURNAL_GROUP_OPS 16
+#define JOURNAL_GROUP_MS 1000
+// metadata blocks one step of an operation changes at most; the group is
+// committed between operations, and between the steps of a long one,
+// when the journal could not hold another step
+#define JOURNAL_OP_BLOCKS 16
+
+struct journal_header
+{
+    uint32_t magic; // JOURNAL_MAGIC or JOURNAL_COMMIT_MAGIC
+    uint32_t seq; // number of the transaction
+    uint32_t count; // number of blocks in the transaction
+    uint32_t checksum; // FNV-1a of the descriptor and the copies, in the commit block
+};
+
+// block owners and chain problems found by fsck, directories and files
+// are numbered from FSCK_FIRST_ID
+#define FSCK_RESERVED 1
+#define FSCK_FIRST_ID 2
+#define FSCK_OK 0
+#define FSCK_BAD_LINK 1 // the chain reaches a free block or one outside the data area
+#define FSCK_CROSS_LINK 2 // the chain reaches a block that is already in use
+
+// A directory is either linear, one block with the directory's own entry
+// (or its parent, "..") in slot 0 followed by the entries, or hashed. A
+// hashed directory keeps slot 0 in its first block, the header block, and
+// a hdir_header right after it, followed by the block numbers of the
+// buckets. An entry lives in the bucket its name hashes to. Every bucket
+// is a FAT chain of blocks of entries, which grows by one block when the
+// bucket is full and the header has no room for more buckets. A chain
+// ends at FAT_EOF or at the first block of another bucket, so the single
+// chain of header and buckets older directories use reads the same way.
+// The magic starts with a zero byte, so a linear directory whose slot 1 is
+// empty or in use never looks hashed.
+#define HDIR_MAGIC 0x48534800 // "\0HSH"
+// buckets of a directory when it outgrows its single block, the bucket
+// count doubles every time a bucket is full
+#define HDIR_MIN_BUCKETS 4
+
+struct hdir_header
+{
+    uint32_t magic; // HDIR_MAGIC
+    uint32_t nbuckets; // number of buckets, a power of two
+};
+
 struct dir_entry
 {
     char file_name[56]; // name of the file / sub-directory
-    uint16_t first_blk; // index in the FAT for the first block of the file
+    uint32_t first_blk; // index in the FAT for the first block of the file
     uint32_t size; // size of the file in bytes
     uint8_t type; // directory (1) or file (0)
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
 
     dir_entry() noexcept : first_blk(0), size(0), type(0), access_rights(0)
     {
-        std::fill(file_name, file_name + sizeof(file_name) - 1, 0);
+        std::fill(file_name, file_name + sizeof(file_name), 0);
     }
 };
 
@@ -39,26 +164,252 @@ class FS
 {
 private:
     Disk disk;
-    // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE / 2];
+    // all file system blocks go through the cache, which writes back on sync
+    BlockCache cache;
+    // bulk transfers keep many requests in flight, bypassing the cache
+    std::unique_ptr<AsyncDisk> aio;
+    AsyncDisk& async_disk();
+    superblock sb;
+    // size of a FAT entry is 4 bytes, the FAT spans sb.fat_blocks blocks
+    std::vector<int32_t> fat;
+    // FAT blocks changed since the last write_fat()
+    std::vector<bool> fat_dirty;
+    // FAT and reference count blocks marked in fat_dirty and ref_dirty
+    unsigned meta_dirty;
+    // free blocks, built from the FAT at mount and kept in step by set_fat()
+    FreeMap free_map;
+    // extra references to each block, and the blocks of them changed since
+    // the last write_fat()
+    std::vector<uint16_t> refs;
+    std::vector<bool> ref_dirty;
+    // counts the shared blocks copied and the blocks moved by defrag, open
+    // files index their chain again when it changes
+    uint64_t cow_gen;
+    // counts the reference counts raised, a block shared since a file was
+    // found to own its chain may be part of the chain now
+    uint64_t share_gen;
+    // dentry cache, the entries of recently used directories by their
+    // first block, so path lookups in them never read the directory
+    struct dentry
+    {
+        dir_entry entry;
+        // where the entry is stored
+        uint32_t block;
+        unsigned slot;
+    };
+    struct dir_cache
+    {
+        dir_entry self; // slot 0, the directory itself or its parent
+        bool hashed;
+        // first blocks of the buckets, a linear directory is one bucket
+        // starting at its own block, and which of them have their entries
+        // in the cache
+        std::vector<uint32_t> buckets;
+        std::vector<uint32_t> heads; // buckets, sorted
+        std::vector<bool> loaded;
+        // per bucket, the slot (counted over its chain) where the search
+        // for a free slot starts, every slot before it is in use
+        std::vector<unsigned> free_hint;
+        std::unordered_map<std::string, dentry> entries;
+    };
+    std::unordered_map<uint32_t, dir_cache> dcache;
+    uint64_t dcache_hits;
+    uint64_t dcache_misses;
+    // last block of recently appended files by their first block, a chain
+    // that grew since is followed from there; owned is share_gen when the
+    // file was last found to share none of its blocks, 0 if it was not
+    struct tail_entry
+    {
+        uint32_t block;
+        uint64_t owned;
+    };
+    std::unordered_map<uint32_t, tail_entry> tails;
+    // size changes of directories not written to their entries yet, by
+    // the directory's first block, with where its entry is
+    struct size_delta
+    {
+        uint32_t parent_blk;
+        std::string name;
+        int64_t delta = 0;
+    };
+    std::unordered_map<uint32_t, size_delta> size_deltas;
+    // open files by handle, with where their entry is
+    struct open_file
+    {
+        uint32_t dir_blk;
+        dir_entry entry;
+        int mode;
+        // the entries from the root down to the file, for its size
+        std::vector<dir_entry> chain;
+        // every stride-th block of the file's chain, indexed blocks of
+        // it and the last of them
+        std::vector<uint32_t> index;
+        unsigned stride;
+        uint64_t indexed;
+        uint32_t last;
+        uint64_t gen;
+    };
+    std::unordered_map<int, open_file> open_files;
+    int next_fd;
+    int alloc_policy;
+    // where the next next-fit search starts
+    unsigned next_fit;
+    // where a defrag that ran out of time continues: the directories left
+    // to scan by path, the names in the one being scanned that are left,
+    // and the file being moved with the run it goes to, its length and
+    // how many of its blocks are in the run already
+    struct defrag_cursor
+    {
+        bool active = false;
+        std::vector<std::string> dirs;
+        std::string dir;
+        std::vector<std::string> names;
+        std::string file;
+        unsigned target = 0;
+        unsigned blocks = 0;
+        unsigned moved = 0;
+        // the file is checked again on the first step of every call
+        bool checked = false;
+    };
+    defrag_cursor defrag;
+    // metadata blocks changed since the last commit, they are pinned in
+    // the cache so they only reach their home location after the commit
+    std::set<unsigned> txn_blocks;
+    // blocks freed since the last commit, they are not reused before it
+    // so the committed metadata never points at overwritten blocks
+    std::vector<unsigned> txn_freed;
+    // open operations, the ones nested in another end with the outermost
+    unsigned txn_depth;
+    // operations in the group since the last commit, and when the first ended
+    unsigned txn_ops;
+    std::chrono::steady_clock::time_point txn_start;
+    uint32_t journal_seq;
+    uint64_t journal_commits;
+    uint64_t journal_group_ops;
+    // brackets one operation, its metadata changes commit with the group
+    // once the operation ends; it holds the lock, so the group is never
+    // committed by the timer in the middle of it; failed is set if the file
+    // system could not be loaded, the operation must return an error
+    struct op_guard
+    {
+        FS& fs;
+        int failed;
+        op_guard(FS& fs) : fs(fs) { fs.mutex.lock(); failed = fs.begin_op(); }
+        ~op_guard() { fs.end_op(); fs.mutex.unlock(); }
+    };
+
+    // commits a group that is JOURNAL_GROUP_MS old when no operation
+    // follows it, only while nobody holds the lock
+    std::recursive_mutex mutex;
+    std::condition_variable_any group_cv;
+    std::thread group_timer;
+    bool stopping;
+
+    // a lazy mount reads the FAT and the reference counts and builds the
+    // free map in the background, a batch at a time under the lock; a
+    // lookup first reads the FAT block it needs, an operation that
+    // allocates or frees blocks reads the rest itself
+    std::thread loader;
+    bool loading;
+    bool load_failed; // every operation fails until the next format
+    unsigned load_next; // next FAT or reference count block the loader reads
+    std::vector<bool> fat_loaded;
 
     //Helper functions
+    int mount(bool lazy);
+    int load_step();
+    int load_all();
+    int check_loaded();
+    int32_t fat_at(unsigned block_no);
+    unsigned fat_entries() { return sb.block_size / sizeof(int32_t); }
+    void set_fat(unsigned block_no, int32_t next);
+    unsigned ref_entries() { return sb.block_size / sizeof(uint16_t); }
+    void set_ref(unsigned block_no, uint16_t extra);
+    void release_chain(int first_blk);
+    bool shares_blocks(int first_blk);
+    int unshare(unsigned dir_blk, dir_entry& entry, uint64_t k);
+    void build_free_map();
+    unsigned max_buckets();
+    dir_cache* load_dir(unsigned dir_blk);
+    std::vector<unsigned> bucket_chain(const dir_cache& dir, unsigned bucket);
+    int load_bucket(dir_cache& dir, unsigned bucket);
+    unsigned bucket_of(const dir_cache& dir, const std::string& name);
+    dentry* lookup(unsigned dir_blk, const std::string& name);
+    int hash_dir(unsigned dir_blk, unsigned nbuckets);
+    int dir_init(unsigned dir_blk, const dir_entry& self);
+    int dir_blocks(unsigned dir_blk, std::vector<unsigned>& block_nos);
+    int dir_list(unsigned dir_blk, std::vector<dir_entry>& entries);
+    int dir_insert(unsigned dir_blk, const dir_entry& entry);
+    int dir_update(unsigned dir_blk, const dir_entry& entry);
+    int dir_remove(unsigned dir_blk, const std::string& name);
+    int dir_set_self(unsigned dir_blk, const dir_entry& self);
+    int write_fat();
+    unsigned journal_capacity();
+    int meta_write(unsigned block_no, const uint8_t* blk);
+    int begin_op();
+    void end_op();
+    int checkpoint();
+    void commit_timer();
+    int journal_write(const std::vector<unsigned>& block_nos);
+    int journal_commit();
+    int journal_replay();
+    void journal_reset();
+    unsigned dir_entries() { return sb.block_size / sizeof(dir_entry); }
     int find_empty();
+    int find_free_run(unsigned numBlocks, int policy);
     std::vector<int> find_multiple_empty(int numBlocks);
+    void count_extents(unsigned dir_blk, unsigned& files, unsigned& extents);
+    int relocate(unsigned dir_blk, const std::string& name);
+    int resolve(std::string filepath, std::vector<dir_entry>& chain);
     dir_entry find_dir_entry(const std::string filepath);
-    int updateSize(uint32_t size, std::string updateFrom);
+    int add_size(const std::vector<dir_entry>& chain, int64_t delta);
+    int flush_sizes();
+    int tail_block(uint32_t first_blk);
+    int refresh(open_file& file);
+    int file_block(open_file& file, uint64_t k);
+    int64_t copy_out(std::string filepath, int out);
+    int create_from(std::string filepath, const std::function<int64_t(uint8_t*, size_t)>& fill);
 
     std::string path;
 public:
-    FS();
+    FS(int backend = DISK_FSTREAM, bool lazy = false);
     ~FS();
-    // formats the disk, i.e., creates an empty file system
-    int format();
+    // a caller that runs several commands holds the lock around each of
+    // them, the group commit timer only runs in between
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+    // formats the disk, i.e., creates an empty file system with no_blocks
+    // blocks of block_size bytes, 0 keeps the current geometry; the old
+    // blocks are discarded, or overwritten with zeros if secure is set
+    int format(unsigned no_blocks = 0, unsigned block_size = 0, bool secure = false);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
+    // create <filepath> <in> creates a new file with the data of the stream
+    int create(std::string filepath, std::istream& in);
+    // create <filepath> <fd> creates a new file with the data read from the
+    // host file descriptor
+    int create(std::string filepath, int fd);
     // cat <filepath> reads the content of a file and prints it on the screen
     int cat(std::string filepath);
+    // open <filepath> returns a handle for the file, with mode the access
+    // rights (READ, WRITE) it is opened with, or -1
+    int open(std::string filepath, int mode = READ);
+    // read copies up to len bytes at offset of the open file to buf, returns
+    // the number of bytes read, 0 at the end of the file, or -1
+    int64_t read(int fd, uint8_t* buf, size_t len, uint64_t offset);
+    // write copies len bytes from buf to offset of the open file, the file grows
+    // if they go past its end and a gap before offset reads as zeros, returns
+    // the number of bytes written or -1
+    int64_t write(int fd, const uint8_t* buf, size_t len, uint64_t offset);
+    // close releases a handle returned by open
+    int close(int fd);
+    // import <hostpath> <filepath> creates a new file with the content of a
+    // file on the host, and reports the throughput
+    int import_file(std::string hostpath, std::string filepath);
+    // export <filepath> <hostpath> copies the content of a file to a file on
+    // the host, and reports the throughput
+    int export_file(std::string filepath, std::string hostpath);
     // ls lists the content in the currect directory (files and sub-directories)
     int ls();
 
@@ -66,7 +417,8 @@ public:
     // <sourcefilepath> to a new file <destfilepath>
     int cp(std::string sourcefilepath, std::string destfilepath);
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
-    // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+    // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory),
+    // the entry is moved and the data stays where it is
     int mv(std::string sourcepath, std::string destpath);
     // rm <filepath> removes / deletes the file <filepath>
     int rm(std::string filepath);
@@ -86,6 +438,22 @@ public:
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+
+    // stats prints the block cache hit/miss/eviction counters, the journal
+    // commits, the free space and how fragmented the files are
+    int stats();
+    // sync commits the journal and writes all dirty cached blocks back to the disk
+    int sync();
+    // alloc <first|next|best> selects how blocks are found for new file data
+    int alloc(std::string policy);
+    // defrag [<ms>] moves fragmented files into contiguous runs of free blocks,
+    // with a time limit it stops after that many milliseconds and a later
+    // call continues where it left off
+    int defragment(unsigned time_ms = 0);
+    // fsck [repair] checks that every block in use belongs to exactly one file or
+    // directory, that file sizes match their FAT chains and that directory sizes
+    // match their contents, with repair the problems found are fixed
+    int fsck(bool repair = false);
 };
 
 #endif // __FS_H__
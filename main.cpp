@@ -1,11 +1,66 @@
+#include <cstring>
 #include "shell.h"
 #include "fs.h"
 #include "disk.h"
+#include "aio.h"
 
 int
 main(int argc, char **argv)
 {
-    Shell shell;
+    // --backend <fstream|mmap|pread> selects how the disk file is accessed
+    // --bench-aio compares asynchronous queue depths on the disk file and exits
+    // --fsck [--repair] checks the file system on the disk file, repairs it if asked to, and exits
+    // --lazy mounts without waiting for the FAT, it is read in the background
+    int backend = DISK_FSTREAM;
+    bool lazy = false;
+    bool bench_aio = false;
+    bool fsck = false, repair = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--backend") && i + 1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "mmap"))
+                backend = DISK_MMAP;
+            else if (!strcmp(argv[i], "pread"))
+                backend = DISK_PREAD;
+            else if (strcmp(argv[i], "fstream"))
+            {
+                std::cerr << "Unknown backend: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--bench-aio"))
+            bench_aio = true;
+        else if (!strcmp(argv[i], "--fsck"))
+            fsck = true;
+        else if (!strcmp(argv[i], "--repair"))
+            repair = true;
+        else if (!strcmp(argv[i], "--lazy"))
+            lazy = true;
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--backend fstream|mmap|pread] [--bench-aio] [--fsck [--repair]] [--lazy]" << std::endl;
+            return 1;
+        }
+    }
+    // --repair only means something together with --fsck, in either order
+    if (repair && !fsck)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--backend fstream|mmap|pread] [--bench-aio] [--fsck [--repair]] [--lazy]" << std::endl;
+        return 1;
+    }
+    if (bench_aio)
+    {
+        Disk disk(backend);
+        return AsyncDisk::benchmark(disk);
+    }
+    if (fsck)
+    {
+        FS filesystem(backend);
+        return filesystem.fsck(repair) ? 1 : 0;
+    }
+    Shell shell(backend, lazy);
     shell.run();
     return 0;
 }
@@ -6,14 +6,16 @@
 #include "fs.h"
 
 std::string commands_str[] = {
-    "format", "create", "cat", "ls",
+    "format", "create", "cat", "ls", "pread", "pwrite",
+    "import", "export",
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
     "chmod",
+    "stats", "sync", "alloc", "defrag", "fsck",
     "help", "quit"
 };
 
-Shell::Shell()
+Shell::Shell(int backend, bool lazy) : filesystem(backend, lazy)
 {
     std::cout << "Starting shell...\n";
 }
@@ -37,6 +39,9 @@ Shell::run()
     {
         std::cout << "filesystem> ";
         std::getline(std::cin, line);
+        // the command runs with the file system locked, the journal's group
+        // commit timer only runs while the shell waits for input
+        std::lock_guard<FS> guard(filesystem);
         std::stringstream linestream(line);
         cmd_line.clear();
         str.clear();
@@ -72,13 +77,31 @@ Shell::run()
 
         if (cmd == "format")
         {
-            if (cmd_line.size() != 1)
+            // a secure format overwrites the old data instead of discarding it
+            bool secure = cmd_line.size() > 1 && cmd_line.back() == "secure";
+            if (secure)
+                cmd_line.pop_back();
+            if (cmd_line.size() > 3)
             {
-                std::cout << "Usage: format\n";
+                std::cout << "Usage: format [<no_blocks> [<block_size>]] [secure]\n";
+                continue;
+            }
+            // the geometry is kept unless it is given
+            unsigned no_blocks = 0, block_size = 0;
+            try
+            {
+                if (cmd_line.size() > 1)
+                    no_blocks = std::stoul(cmd_line[1]);
+                if (cmd_line.size() > 2)
+                    block_size = std::stoul(cmd_line[2]);
+            }
+            catch (const std::exception&)
+            {
+                std::cout << "Usage: format [<no_blocks> [<block_size>]] [secure]\n";
                 continue;
             }
             // check return value so everything is ok
-            ret_val = filesystem.format();
+            ret_val = filesystem.format(no_blocks, block_size, secure);
             if (ret_val)
                 std::cout << "Error: format failed, error code " << ret_val << std::endl;
         }
@@ -118,6 +141,62 @@ Shell::run()
             }
         }
 
+        else if (cmd == "pread" || cmd == "pwrite")
+        {
+            bool writing = cmd == "pwrite";
+            const char* usage = writing ? "Usage: pwrite <file> <offset> <data>\n" : "Usage: pread <file> <offset> <length>\n";
+            if (cmd_line.size() != 4)
+            {
+                std::cout << usage;
+                continue;
+            }
+            uint64_t offset = 0, length = 0;
+            try
+            {
+                offset = std::stoull(cmd_line[2]);
+                if (!writing)
+                    length = std::stoull(cmd_line[3]);
+            }
+            catch (const std::exception&)
+            {
+                std::cout << usage;
+                continue;
+            }
+            arg1 = cmd_line[1];
+            int fd = filesystem.open(arg1, writing ? WRITE : READ);
+            int64_t done = -1;
+            if (fd >= 0)
+            {
+                if (writing)
+                    done = filesystem.write(fd, (const uint8_t*)cmd_line[3].data(), cmd_line[3].size(), offset);
+                else
+                {
+                    // the data is printed a buffer at a time, the length
+                    // may be far larger than the file
+                    std::vector<uint8_t> buf(PREAD_BUFFER_SIZE);
+                    int64_t n = 0;
+                    for (done = 0; (uint64_t)done < length; done += n)
+                    {
+                        n = filesystem.read(fd, buf.data(), std::min((uint64_t)buf.size(), length - done), offset + done);
+                        if (n <= 0)
+                            break;
+                        std::cout.write((const char*)buf.data(), n);
+                    }
+                    if (n < 0)
+                        done = -1;
+                    else
+                        std::cout << std::endl;
+                }
+                filesystem.close(fd);
+            }
+            // check return value so everything is ok
+            if (done < 0)
+            {
+                std::cout << "Error: " << cmd << " " << arg1;
+                std::cout << " failed, error code " << done << std::endl;
+            }
+        }
+
         else if (cmd == "ls")
         {
             if (cmd_line.size() != 1)
@@ -131,6 +210,42 @@ Shell::run()
                 std::cout << "Error: ls failed, error code " << ret_val << std::endl;
         }
 
+        else if (cmd == "import")
+        {
+            if (cmd_line.size() != 3)
+            {
+                std::cout << "Usage: import <hostpath> <file>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            arg2 = cmd_line[2];
+            // check return value so everything is ok
+            ret_val = filesystem.import_file(arg1, arg2);
+            if (ret_val)
+            {
+                std::cout << "Error: import " << arg1 << " " << arg2;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "export")
+        {
+            if (cmd_line.size() != 3)
+            {
+                std::cout << "Usage: export <file> <hostpath>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            arg2 = cmd_line[2];
+            // check return value so everything is ok
+            ret_val = filesystem.export_file(arg1, arg2);
+            if (ret_val)
+            {
+                std::cout << "Error: export " << arg1 << " " << arg2;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "cp")
         {
             if (cmd_line.size() != 3)
@@ -267,13 +382,94 @@ Shell::run()
             }
         }
 
+        else if (cmd == "stats")
+        {
+            if (cmd_line.size() != 1)
+            {
+                std::cout << "Usage: stats\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.stats();
+            if (ret_val)
+                std::cout << "Error: stats failed, error code " << ret_val << std::endl;
+        }
+
+        else if (cmd == "sync")
+        {
+            if (cmd_line.size() != 1)
+            {
+                std::cout << "Usage: sync\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.sync();
+            if (ret_val)
+                std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+        }
+
+        else if (cmd == "alloc")
+        {
+            if (cmd_line.size() != 2)
+            {
+                std::cout << "Usage: alloc <first|next|best>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            // check return value so everything is ok
+            ret_val = filesystem.alloc(arg1);
+            if (ret_val)
+            {
+                std::cout << "Error: alloc " << arg1;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "defrag")
+        {
+            if (cmd_line.size() > 2)
+            {
+                std::cout << "Usage: defrag [<milliseconds>]\n";
+                continue;
+            }
+            // without a time limit everything is defragmented at once
+            unsigned time_ms = 0;
+            try
+            {
+                if (cmd_line.size() > 1)
+                    time_ms = std::stoul(cmd_line[1]);
+            }
+            catch (const std::exception&)
+            {
+                std::cout << "Usage: defrag [<milliseconds>]\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.defragment(time_ms);
+            if (ret_val)
+                std::cout << "Error: defrag failed, error code " << ret_val << std::endl;
+        }
+
+        else if (cmd == "fsck")
+        {
+            if (cmd_line.size() > 2 || (cmd_line.size() == 2 && cmd_line[1] != "repair"))
+            {
+                std::cout << "Usage: fsck [repair]\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.fsck(cmd_line.size() == 2);
+            if (ret_val)
+                std::cout << "Error: fsck failed, error code " << ret_val << std::endl;
+        }
+
         else if (cmd == "quit")
             running = false;
 
         else if (cmd == "help")
         {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, pread, pwrite, import, export, cp, mv, rm, append, mkdir, cd, pwd, chmod, stats, sync, alloc, defrag, fsck, help, quit\n";
         }
 
         else if (cmd == "")
@@ -284,7 +480,7 @@ Shell::run()
         else
         {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, pread, pwrite, import, export, cp, mv, rm, append, mkdir, cd, pwd, chmod, stats, sync, alloc, defrag, fsck, help, quit\n";
         }
     }
 }
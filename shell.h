@@ -4,11 +4,14 @@
 #ifndef __SHELL_H__
 #define __SHELL_H__
 
+// bytes pread reads and prints at a time
+#define PREAD_BUFFER_SIZE 65536
+
 class Shell {
 private:
     FS filesystem;
 public:
-    Shell();
+    Shell(int backend = DISK_FSTREAM, bool lazy = false);
     ~Shell();
     void run();
 };